@@ -0,0 +1,485 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <system_error>
+#include <sys/epoll.h>
+#include "stream.h"
+
+// C++20 协程版本的流：co_await in.async_read(...) / async_getline / out.async_write(...)
+// 一个线程上的 EventLoop 用 epoll 等待 fd 就绪，成千上万个非阻塞 fd 不再需要每个占一个线程。
+// 普通文件不能加到 epoll 里，它们总是当作就绪处理。
+
+template <class T = void>
+struct Task;
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+    bool running_inline = false;    // 正在 Task::await_suspend 里同步地跑
+    bool finished = false;
+
+    std::suspend_always initial_suspend() noexcept {
+        return {};
+    }
+
+    // 同步跑完的话什么都不做，由 await_suspend 返回 false 让调用者直接继续，栈不会越嵌越深；
+    // 中途挂起过的话，是事件循环把它唤醒的，这时接着恢复调用者
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        template <class P>
+        void await_suspend(std::coroutine_handle<P> h) noexcept {
+            auto &p = h.promise();
+            p.finished = true;
+            if (!p.running_inline && p.continuation)
+                p.continuation.resume();
+        }
+
+        void await_resume() noexcept {
+        }
+    };
+
+    FinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() {
+        error = std::current_exception();
+    }
+};
+
+template <class T>
+struct Promise : PromiseBase {
+    T value{};
+
+    Task<T> get_return_object();
+
+    void return_value(T v) {
+        value = std::move(v);
+    }
+
+    T result() {
+        if (error)
+            std::rethrow_exception(error);
+        return std::move(value);
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+
+    void return_void() {
+    }
+
+    void result() {
+        if (error)
+            std::rethrow_exception(error);
+    }
+};
+
+}
+
+// 惰性启动：被 co_await 或者交给 EventLoop::spawn 才开始跑
+template <class T>
+struct [[nodiscard]] Task {
+    using promise_type = detail::Promise<T>;
+
+private:
+    std::coroutine_handle<promise_type> h;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> h_) : h(h_) {
+    }
+
+    Task(Task &&that) noexcept : h(std::exchange(that.h, nullptr)) {
+    }
+
+    Task &operator=(Task &&that) noexcept {
+        if (this != &that) {
+            if (h)
+                h.destroy();
+            h = std::exchange(that.h, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (h)
+            h.destroy();
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> caller) {
+        auto &p = h.promise();
+        p.continuation = caller;
+        p.running_inline = true;
+        h.resume();
+        p.running_inline = false;
+        return !p.finished;
+    }
+
+    T await_resume() {
+        return h.promise().result();
+    }
+};
+
+namespace detail {
+
+template <class T>
+Task<T> Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// spawn 出去的顶层协程，跑完自己销毁
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() {
+            return Detached{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+}
+
+
+struct EventLoop {
+private:
+    struct Waiters {
+        std::coroutine_handle<> reader;
+        std::coroutine_handle<> writer;
+        bool registered = false;
+    };
+
+    int epfd;
+    std::unordered_map<int, Waiters> waiters;
+    std::deque<std::coroutine_handle<>> ready;
+    size_t live = 0;
+    std::exception_ptr error;
+
+    void update(int fd, Waiters &w) {
+        uint32_t events = (w.reader ? (uint32_t)EPOLLIN : 0u) | (w.writer ? (uint32_t)EPOLLOUT : 0u);
+        if (events == 0) {
+            if (w.registered)
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+            waiters.erase(fd);
+            return;
+        }
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, w.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0) {
+            if (errno == EPERM) {
+                // 普通文件不支持 epoll，永远就绪
+                if (w.reader)
+                    ready.push_back(w.reader);
+                if (w.writer)
+                    ready.push_back(w.writer);
+                waiters.erase(fd);
+                return;
+            }
+            throw std::system_error(errno, std::generic_category());
+        }
+        w.registered = true;
+    }
+
+    static detail::Detached run_detached(EventLoop *loop, Task<void> t) {
+        try {
+            co_await t;
+        } catch (...) {
+            if (!loop->error)
+                loop->error = std::current_exception();
+        }
+        --loop->live;
+    }
+
+public:
+    EventLoop() {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0) {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    EventLoop(EventLoop &&) = delete;
+
+    ~EventLoop() {
+        ::close(epfd);
+    }
+
+    void spawn(Task<void> t) {
+        ++live;
+        ready.push_back(run_detached(this, std::move(t)).h);
+    }
+
+    // 挂起 h 直到 fd 可读 / 可写
+    void wait_fd(int fd, std::coroutine_handle<> h, bool for_write) {
+        Waiters &w = waiters[fd];
+        (for_write ? w.writer : w.reader) = h;
+        update(fd, w);
+    }
+
+    struct FdAwaiter {
+        EventLoop *loop;
+        int fd;
+        bool for_write;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            loop->wait_fd(fd, h, for_write);
+        }
+
+        void await_resume() const noexcept {
+        }
+    };
+
+    FdAwaiter readable(int fd) {
+        return {this, fd, false};
+    }
+
+    FdAwaiter writable(int fd) {
+        return {this, fd, true};
+    }
+
+    // 跑到所有 spawn 的任务结束，任务里抛出的第一个异常在这里重新抛出
+    void run() {
+        epoll_event evs[64];
+        while (true) {
+            while (!ready.empty()) {
+                auto h = ready.front();
+                ready.pop_front();
+                h.resume();
+            }
+            if (error) {
+                std::exception_ptr e = error;
+                error = nullptr;
+                std::rethrow_exception(e);
+            }
+            if (live == 0)
+                break;
+            if (waiters.empty()) {
+                // 还有任务没结束，但谁都没在等 fd，再等下去就永远醒不来了
+                throw std::system_error(EDEADLK, std::generic_category());
+            }
+            int n = epoll_wait(epfd, evs, 64, -1);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category());
+            }
+            for (int i = 0; i < n; ++i) {
+                int fd = evs[i].data.fd;
+                auto it = waiters.find(fd);
+                if (it == waiters.end())
+                    continue;
+                Waiters &w = it->second;
+                uint32_t e = evs[i].events;
+                if ((e & (EPOLLIN | EPOLLHUP | EPOLLERR)) && w.reader) {
+                    ready.push_back(w.reader);
+                    w.reader = nullptr;
+                }
+                if ((e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && w.writer) {
+                    ready.push_back(w.writer);
+                    w.writer = nullptr;
+                }
+                update(fd, w);
+            }
+        }
+    }
+};
+
+
+// 同步接口在 EAGAIN 时用 poll 阻塞等待，所以也能当普通 InStream 用
+struct AsyncInStream : InStream {
+private:
+    EventLoop &loop;
+    int fd;
+    char *buf;
+    size_t top = 0;
+    size_t max = 0;
+
+    // 一次系统调用，返回 -1 表示 EAGAIN
+    ssize_t try_read(char *s, size_t len) {
+        while (true) {
+            ssize_t n = ::read(fd, s, len);
+            if (n >= 0)
+                return n;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return -1;
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    Task<bool> async_refill() {
+        top = max = 0;
+        ssize_t n;
+        while ((n = try_read(buf, BUFSIZ)) < 0)
+            co_await loop.readable(fd);
+        max = n;
+        co_return n != 0;
+    }
+
+public:
+    AsyncInStream(EventLoop &loop_, int fd_)
+        : loop(loop_)
+        , fd(fd_)
+    {
+        set_fd_nonblocking(fd, true);
+        buf = BufferPool::instance().allocate(BUFSIZ);
+    }
+
+    size_t read(char *__restrict s, size_t len) override {
+        if (len == 0)
+            return 0;
+        if (top != max) {
+            size_t n = std::min(len, max - top);
+            memcpy(s, buf + top, n);
+            top += n;
+            return n;
+        }
+        ssize_t n;
+        while ((n = try_read(s, len)) < 0)
+            poll_fd(fd, POLLIN);
+        return n;
+    }
+
+    Task<size_t> async_read(char *s, size_t len) {
+        if (len == 0)
+            co_return 0;
+        if (top != max) {
+            size_t n = std::min(len, max - top);
+            memcpy(s, buf + top, n);
+            top += n;
+            co_return n;
+        }
+        ssize_t n;
+        while ((n = try_read(s, len)) < 0)
+            co_await loop.readable(fd);
+        co_return n;
+    }
+
+    // 和 InStream::getline 一样，不包含 eol；EOF 时返回剩下的部分
+    Task<std::string> async_getline(char eol = '\n') {
+        std::string ret;
+        while (true) {
+            if (top == max && !co_await async_refill())
+                co_return ret;
+            const char *p = buf + top;
+            const char *e = (const char *)memchr(p, eol, max - top);
+            if (e != nullptr) {
+                ret.append(p, e - p);
+                top = e + 1 - buf;
+                co_return ret;
+            }
+            ret.append(p, max - top);
+            top = max;
+        }
+    }
+
+    AsyncInStream(AsyncInStream &&) = delete;
+
+    ~AsyncInStream() {
+        BufferPool::instance().release(buf, BUFSIZ);
+        ::close(fd);
+    }
+};
+
+struct AsyncOutStream : OutStream {
+private:
+    EventLoop &loop;
+    int fd;
+
+    ssize_t try_write(const char *s, size_t len) {
+        while (true) {
+            ssize_t n = ::write(fd, s, len);
+            if (n >= 0)
+                return n;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return -1;
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+public:
+    AsyncOutStream(EventLoop &loop_, int fd_)
+        : loop(loop_)
+        , fd(fd_)
+    {
+        set_fd_nonblocking(fd, true);
+    }
+
+    void write(const char *__restrict s, size_t len) override {
+        while (len != 0) {
+            ssize_t n = try_write(s, len);
+            if (n < 0) {
+                poll_fd(fd, POLLOUT);
+                continue;
+            }
+            s += n;
+            len -= n;
+        }
+    }
+
+    // 写完全部 len 字节才返回，对端慢的时候挂起而不是阻塞线程
+    Task<void> async_write(const char *s, size_t len) {
+        while (len != 0) {
+            ssize_t n = try_write(s, len);
+            if (n < 0) {
+                co_await loop.writable(fd);
+                continue;
+            }
+            s += n;
+            len -= n;
+        }
+    }
+
+    Task<void> async_write(std::string s) {
+        co_await async_write(s.data(), s.size());
+    }
+
+    AsyncOutStream(AsyncOutStream &&) = delete;
+
+    ~AsyncOutStream() {
+        ::close(fd);
+    }
+};
@@ -0,0 +1,584 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <exception>
+#include <bit>
+#include <type_traits>
+#include <unistd.h>
+#include "stream.h"
+#include "byteio.h"
+#include "strview.h"
+
+// 二进制日志：调用处只把格式串的编号和参数的原始字节写进本线程的环形缓冲区，不做任何格式化，
+// 也不碰锁和系统调用。格式化留给后台线程（Text 模式），或者原样写出去（Binary 模式），
+// 事后再用 binlogcat 解成文本。
+//
+//   BINLOG("open %s failed: %d", path, errno);
+//
+// 格式串按 printf 写，长度修饰符可以不写也可以照写（解码时统一按 64 位取）。
+// 参数只支持整数、char、浮点数、字符串（const char * / std::string / std::string_view / StrView）和指针，
+// 宽度和精度不能用 *。缓冲区满了的那一条直接丢掉并计数，调用处永远不会被阻塞。
+//
+// Binary 模式的格式，整数都是小端：
+//   "BINLOG01"
+//   'F' [id:u32][line:u32][len:u32][file][len:u32][sig][len:u32][fmt]   格式串登记，第一次用到之前写
+//   'R' [tid:u32][id:u32][len:u32][ts:u64][参数]                          一条日志，len 含 16 字节头
+//   'D' [tid:u32][count:u64]                                              这个线程又丢了多少条
+// ts 是 Unix 纪元以来的纳秒。参数按格式串登记时的 sig 依次排列：
+//   'i' 有符号整数 i64、'u' 无符号整数 u64、'c' char 1 字节、'd' double 的位 u64、
+//   's' [len:u32][字节]、'p' 指针 u64
+
+namespace binlog {
+
+constexpr char kMagic[8] = {'B', 'I', 'N', 'L', 'O', 'G', '0', '1'};
+constexpr size_t kHeaderSize = 16;
+constexpr uint32_t kWrap = UINT32_MAX;     // 环形缓冲区里的占位：后面到末尾都不用，从头接着读
+
+struct Format {
+    std::string fmt;
+    std::string sig;
+    std::string file;
+    uint32_t line;
+};
+
+template <class T>
+constexpr char type_code() {
+    using U = std::remove_cv_t<T>;
+    if constexpr (std::is_same_v<U, char>)
+        return 'c';
+    else if constexpr (std::is_same_v<U, bool>)
+        return 'u';
+    else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>)
+        return 'i';
+    else if constexpr (std::is_integral_v<U>)
+        return 'u';
+    else if constexpr (std::is_enum_v<U>)
+        return type_code<std::underlying_type_t<U>>();
+    else if constexpr (std::is_floating_point_v<U>)
+        return 'd';
+    else if constexpr (std::is_same_v<U, const char *> || std::is_same_v<U, char *>
+                       || std::is_same_v<U, std::string> || std::is_same_v<U, std::string_view>
+                       || std::is_same_v<U, StrView>)
+        return 's';
+    else if constexpr (std::is_pointer_v<U>)
+        return 'p';
+    else
+        static_assert(sizeof(U) == 0, "BINLOG 不支持这种参数类型");
+}
+
+template <class... T>
+struct TypeList {};
+
+// 只在 decltype 里用，参数不会被求值两次
+template <class... T>
+TypeList<std::decay_t<T>...> type_list(T &&...);
+
+template <class... T>
+std::string signature(TypeList<T...>) {
+    return std::string{type_code<T>()...};
+}
+
+inline std::string_view as_view(const char *s) {
+    return s != nullptr ? std::string_view(s) : std::string_view("(null)");
+}
+
+inline std::string_view as_view(std::string const &s) {
+    return s;
+}
+
+inline std::string_view as_view(std::string_view s) {
+    return s;
+}
+
+inline std::string_view as_view(StrView s) {
+    return s;
+}
+
+template <class T>
+size_t arg_size(T const &v) {
+    constexpr char c = type_code<std::decay_t<T>>();
+    if constexpr (c == 'c')
+        return 1;
+    else if constexpr (c == 's')
+        return 4 + as_view(v).size();
+    else
+        return 8;
+}
+
+template <class T>
+char *encode(char *p, T const &v) {
+    constexpr char c = type_code<std::decay_t<T>>();
+    if constexpr (c == 'c') {
+        *p = v;
+        return p + 1;
+    } else if constexpr (c == 's') {
+        std::string_view s = as_view(v);
+        store_le32(p, (uint32_t)s.size());
+        memcpy(p + 4, s.data(), s.size());
+        return p + 4 + s.size();
+    } else if constexpr (c == 'd') {
+        store_le64(p, std::bit_cast<uint64_t>((double)v));
+        return p + 8;
+    } else if constexpr (c == 'p') {
+        store_le64(p, (uint64_t)(uintptr_t)v);
+        return p + 8;
+    } else if constexpr (c == 'i') {
+        store_le64(p, (uint64_t)(int64_t)v);
+        return p + 8;
+    } else {
+        store_le64(p, (uint64_t)v);
+        return p + 8;
+    }
+}
+
+// 单生产者单消费者：生产者是所属线程，消费者是后台线程。
+// head/tail 是一直增长的字节偏移，每条记录 8 字节对齐且在缓冲区里连续，放不下就用 kWrap 跳回开头
+struct Ring {
+    char *buf;
+    size_t cap;                     // 2 的幂
+    uint32_t tid;
+    alignas(64) std::atomic<uint64_t> head{0};
+    uint64_t next = 0;              // 生产者：reserve 之后 commit 要发布到的位置
+    std::atomic<uint64_t> dropped{0};
+    alignas(64) std::atomic<uint64_t> tail{0};
+    uint64_t reported = 0;          // 消费者：已经报告过的丢弃条数
+    std::atomic<bool> retired{false};
+
+    // 放不下返回 nullptr，这一条算丢了
+    char *reserve(size_t len) {
+        size_t need = (len + 7) & ~(size_t)7;
+        uint64_t h = head.load(std::memory_order_relaxed);
+        size_t off = h & (cap - 1);
+        size_t pad = off + need > cap ? cap - off : 0;
+        if (h + pad + need - tail.load(std::memory_order_acquire) > cap) {
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        if (pad != 0) {
+            store_le32(buf + off, kWrap);
+            h += pad;
+        }
+        next = h + need;
+        return buf + (h & (cap - 1));
+    }
+
+    void commit() {
+        head.store(next, std::memory_order_release);
+    }
+};
+
+inline bool take(const char *&p, const char *e, size_t n) {
+    if ((size_t)(e - p) < n)
+        return false;
+    p += n;
+    return true;
+}
+
+template <class T>
+void append_printf(std::string &out, const char *spec, T v) {
+    char tmp[128];
+    int n = snprintf(tmp, sizeof(tmp), spec, v);
+    if (n < 0)
+        return;
+    if ((size_t)n < sizeof(tmp)) {
+        out.append(tmp, n);
+        return;
+    }
+    size_t old = out.size();
+    out.resize(old + n + 1);
+    snprintf(&out[old], n + 1, spec, v);
+    out.resize(old + n);
+}
+
+// 按登记的格式串和 sig 把参数还原成文本，追加到 out 后面；参数不够或者数据截断的地方输出 <?>
+inline void format_args(std::string &out, Format const &f, const char *p, size_t len) {
+    const char *e = p + len;
+    const char *fmt = f.fmt.c_str();
+    size_t arg = 0;
+    std::string spec;
+    while (*fmt) {
+        if (*fmt != '%') {
+            const char *q = strchr(fmt, '%');
+            size_t n = q ? (size_t)(q - fmt) : strlen(fmt);
+            out.append(fmt, n);
+            fmt += n;
+            continue;
+        }
+        if (fmt[1] == '%') {
+            out += '%';
+            fmt += 2;
+            continue;
+        }
+        // %[flags][width][.precision][length]conv，长度修饰符丢掉，按取出来的类型重新加
+        spec.assign(1, '%');
+        ++fmt;
+        while (*fmt && strchr("-+ #0123456789.", *fmt))
+            spec += *fmt++;
+        while (*fmt && strchr("hlLqjzt", *fmt))
+            ++fmt;
+        char conv = *fmt;
+        if (conv == '\0')
+            break;
+        ++fmt;
+        char code = arg < f.sig.size() ? f.sig[arg++] : '\0';
+        const char *q = p;
+        bool ok = false;
+        switch (code) {
+        case 'i':
+        case 'u':
+        case 'p':
+        case 'd':
+            if (!take(p, e, 8))
+                break;
+            ok = true;
+            if (code == 'd') {
+                double v = std::bit_cast<double>(load_le64(q));
+                if (strchr("fFeEgGaA", conv))
+                    append_printf(out, (spec + conv).c_str(), v);
+                else
+                    append_printf(out, (spec + 'g').c_str(), v);
+            } else if (code == 'p' || conv == 'p') {
+                append_printf(out, (spec + 'p').c_str(), (void *)(uintptr_t)load_le64(q));
+            } else if (conv == 'c') {
+                append_printf(out, (spec + 'c').c_str(), (int)load_le64(q));
+            } else if (strchr("fFeEgGaA", conv)) {
+                double v = code == 'i' ? (double)(int64_t)load_le64(q) : (double)load_le64(q);
+                append_printf(out, (spec + conv).c_str(), v);
+            } else {
+                if (!strchr("diouxX", conv))
+                    conv = code == 'i' ? 'd' : 'u';
+                append_printf(out, (spec + "ll" + conv).c_str(), (unsigned long long)load_le64(q));
+            }
+            break;
+        case 'c':
+            if (!take(p, e, 1))
+                break;
+            ok = true;
+            if (conv == 'c' || conv == 's')
+                append_printf(out, (spec + 'c').c_str(), (int)(unsigned char)*q);
+            else
+                append_printf(out, (spec + "d").c_str(), (int)*q);
+            break;
+        case 's': {
+            if (!take(p, e, 4))
+                break;
+            size_t n = load_le32(q);
+            if (!take(p, e, n))
+                break;
+            ok = true;
+            std::string s(q + 4, n);
+            append_printf(out, (spec + 's').c_str(), s.c_str());
+            break;
+        }
+        default:
+            break;
+        }
+        if (!ok)
+            out += "<?>";
+    }
+}
+
+// 文本格式的一行："2026-01-02 03:04:05.123456 [tid] 消息\n"
+struct TextFormatter {
+    time_t last_sec = -1;
+    char stamp[32];
+
+    void line(std::string &out, Format const &f, uint32_t tid, uint64_t ts, const char *p, size_t len) {
+        time_t sec = ts / 1000000000;
+        if (sec != last_sec) {
+            tm t;
+            localtime_r(&sec, &t);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &t);
+            last_sec = sec;
+        }
+        char head[64];
+        int n = snprintf(head, sizeof(head), "%s.%06u [%u] ", stamp, (unsigned)(ts % 1000000000 / 1000), tid);
+        out.append(head, n);
+        format_args(out, f, p, len);
+        out += '\n';
+    }
+
+    void dropped(std::string &out, uint32_t tid, uint64_t count) {
+        char tmp[64];
+        int n = snprintf(tmp, sizeof(tmp), "binlog: thread %u dropped %llu records\n", tid, (unsigned long long)count);
+        out.append(tmp, n);
+    }
+};
+
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace binlog
+
+struct BinLogger {
+    enum Mode {
+        Text,       // 后台线程格式化成文本行
+        Binary,     // 原样写出，用 binlogcat 解码
+    };
+
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<binlog::Format> formats;
+    std::vector<binlog::Ring *> rings;
+    size_t ring_size = 256 * 1024;
+    bool started = false;
+    uint64_t flush_req = 0;
+    uint64_t flush_done = 0;
+    std::exception_ptr bg_error;
+
+    // 下面这些只有后台线程碰
+    std::unique_ptr<OutStream> sink;
+    Mode mode = Text;
+    std::chrono::milliseconds period{10};
+    std::vector<binlog::Format> known;      // formats 的副本，读的时候不用加锁
+    std::vector<bool> defined;              // Binary 模式下已经写过 'F' 的编号
+    std::string pending;
+    binlog::TextFormatter text;
+
+    static inline thread_local binlog::Ring *tring = nullptr;
+    static inline thread_local bool tring_gone = false;
+
+    struct RingHolder {
+        binlog::Ring *r;
+
+        ~RingHolder() {
+            tring = nullptr;
+            tring_gone = true;
+            r->retired.store(true, std::memory_order_release);
+        }
+    };
+
+    BinLogger() = default;
+
+    binlog::Ring *new_ring() {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto *r = new binlog::Ring;
+        r->cap = ring_size;
+        r->buf = BufferPool::instance().allocate(r->cap);
+        r->tid = (uint32_t)gettid();
+        rings.push_back(r);
+        return r;
+    }
+
+    binlog::Ring *thread_ring() {
+        if (tring == nullptr && !tring_gone) {
+            static thread_local RingHolder holder{new_ring()};
+            tring = holder.r;
+        }
+        return tring;
+    }
+
+    binlog::Format const &format_of(uint32_t id) {
+        if (id >= known.size()) {
+            std::lock_guard<std::mutex> lock(mtx);
+            known.assign(formats.begin(), formats.end());
+        }
+        return known[id];
+    }
+
+    void put_u32(uint32_t v) {
+        char b[4];
+        store_le32(b, v);
+        pending.append(b, 4);
+    }
+
+    void put_str(std::string const &s) {
+        put_u32((uint32_t)s.size());
+        pending += s;
+    }
+
+    void emit(binlog::Ring &r, const char *rec, size_t len) {
+        uint32_t id = load_le32(rec);
+        binlog::Format const &f = format_of(id);
+        if (mode == Text) {
+            text.line(pending, f, r.tid, load_le64(rec + 8), rec + binlog::kHeaderSize, len - binlog::kHeaderSize);
+            return;
+        }
+        if (id >= defined.size())
+            defined.resize(id + 1);
+        if (!defined[id]) {
+            defined[id] = true;
+            pending += 'F';
+            put_u32(id);
+            put_u32(f.line);
+            put_str(f.file);
+            put_str(f.sig);
+            put_str(f.fmt);
+        }
+        pending += 'R';
+        put_u32(r.tid);
+        pending.append(rec, len);
+    }
+
+    void drain(binlog::Ring &r) {
+        uint64_t t = r.tail.load(std::memory_order_relaxed);
+        uint64_t h = r.head.load(std::memory_order_acquire);
+        while (t != h) {
+            size_t off = t & (r.cap - 1);
+            const char *rec = r.buf + off;
+            uint32_t id = load_le32(rec);
+            if (id == binlog::kWrap) {
+                t += r.cap - off;
+                continue;
+            }
+            size_t len = load_le32(rec + 4);
+            emit(r, rec, len);
+            t += (len + 7) & ~(size_t)7;
+        }
+        r.tail.store(t, std::memory_order_release);
+        uint64_t d = r.dropped.load(std::memory_order_relaxed);
+        if (d != r.reported) {
+            if (mode == Text) {
+                text.dropped(pending, r.tid, d - r.reported);
+            } else {
+                char b[12];
+                store_le32(b, r.tid);
+                store_le64(b + 4, d - r.reported);
+                pending += 'D';
+                pending.append(b, 12);
+            }
+            r.reported = d;
+        }
+    }
+
+    // 把所有线程的缓冲区倒空。退出了的线程先看到 retired 再倒，保证它最后写的都能拿到
+    void drain_all() {
+        std::vector<binlog::Ring *> rs;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            rs = rings;
+        }
+        std::vector<binlog::Ring *> gone;
+        for (binlog::Ring *r: rs) {
+            bool retired = r->retired.load(std::memory_order_acquire);
+            drain(*r);
+            if (retired)
+                gone.push_back(r);
+        }
+        if (!pending.empty()) {
+            sink->write(pending.data(), pending.size());
+            sink->flush();
+            pending.clear();
+        }
+        if (gone.empty())
+            return;
+        std::lock_guard<std::mutex> lock(mtx);
+        for (binlog::Ring *r: gone) {
+            std::erase(rings, r);
+            BufferPool::instance().release(r->buf, r->cap);
+            delete r;
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            cv.wait_for(lock, period, [&] { return flush_req != flush_done; });
+            uint64_t req = flush_req;
+            lock.unlock();
+            std::exception_ptr e;
+            try {
+                drain_all();
+            } catch (...) {
+                e = std::current_exception();
+                pending.clear();
+            }
+            lock.lock();
+            if (e && !bg_error)
+                bg_error = e;
+            flush_done = req;
+            cv.notify_all();
+        }
+    }
+
+public:
+    // 和 BufferPool 一样故意不析构，线程退出时还要来交还缓冲区
+    static BinLogger &instance() {
+        static BinLogger *p = new BinLogger;
+        return *p;
+    }
+
+    // 每个调用处第一次执行时登记一次（见 BINLOG），返回格式串的编号
+    uint32_t register_format(const char *fmt, std::string sig, const char *file, unsigned line) {
+        std::lock_guard<std::mutex> lock(mtx);
+        formats.push_back({fmt, std::move(sig), file, line});
+        return (uint32_t)(formats.size() - 1);
+    }
+
+    // 之后新开始写日志的线程用多大的缓冲区，向上取到 2 的幂
+    void set_thread_buffer(size_t size) {
+        size_t cap = 4096;
+        while (cap < size)
+            cap <<= 1;
+        std::lock_guard<std::mutex> lock(mtx);
+        ring_size = cap;
+    }
+
+    // 启动后台线程，每 period 把所有线程的缓冲区倒进 sink 一次。只能调用一次，
+    // 在这之前写的日志留在缓冲区里（满了就丢），启动后一起写出去
+    void start(std::unique_ptr<OutStream> sink_, Mode mode_ = Text,
+               std::chrono::milliseconds period_ = std::chrono::milliseconds(10)) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (started)
+            return;
+        started = true;
+        sink = std::move(sink_);
+        mode = mode_;
+        period = period_;
+        if (mode == Binary)
+            pending.assign(binlog::kMagic, sizeof(binlog::kMagic));
+        std::thread([this] { run(); }).detach();
+    }
+
+    // 等到调用之前写下的日志都交给 sink；后台写出失败的错误在这里抛出
+    void flush() {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!started)
+            return;
+        uint64_t my = ++flush_req;
+        cv.notify_all();
+        cv.wait(lock, [&] { return flush_done >= my; });
+        if (bg_error)
+            std::rethrow_exception(std::exchange(bg_error, nullptr));
+    }
+
+    // 热路径：算长度、在本线程的缓冲区里占位、拷参数、发布，别的什么都不做
+    template <class... Args>
+    void log(uint32_t id, Args const &... args) {
+        binlog::Ring *r = thread_ring();
+        if (r == nullptr)
+            return;
+        size_t len = binlog::kHeaderSize + (binlog::arg_size(args) + ... + 0);
+        char *p = r->reserve(len);
+        if (p == nullptr)
+            return;
+        store_le32(p, id);
+        store_le32(p + 4, (uint32_t)len);
+        store_le64(p + 8, binlog::now_ns());
+        p += binlog::kHeaderSize;
+        ((p = binlog::encode(p, args)), ...);
+        r->commit();
+    }
+
+    BinLogger(BinLogger &&) = delete;
+};
+
+#define BINLOG(fmt, ...) \
+    do { \
+        static const uint32_t binlog_id_ = BinLogger::instance().register_format( \
+                fmt, binlog::signature(decltype(binlog::type_list(__VA_ARGS__)){}), __FILE__, __LINE__); \
+        BinLogger::instance().log(binlog_id_ __VA_OPT__(,) __VA_ARGS__); \
+    } while (0)
@@ -0,0 +1,108 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "stream.h"
+#include "binlog.h"
+
+// 把 BinLogger 的 Binary 模式输出解成文本，格式和 Text 模式一样。
+//
+// 用法：binlogcat [文件...]
+// 没有文件时读 stdin。
+
+static void usage() {
+    fprintf(stderr, "usage: binlogcat [file...]\n");
+    exit(2);
+}
+
+struct Decoder {
+    std::vector<binlog::Format> formats;
+    binlog::TextFormatter text;
+    std::string line;
+    std::string rec;
+
+    static uint32_t get_u32(InStream &in) {
+        char b[4];
+        if (in.readn(b, 4) != 4)
+            throw std::runtime_error("truncated binlog");
+        return load_le32(b);
+    }
+
+    static std::string get_str(InStream &in) {
+        std::string s(get_u32(in), '\0');
+        if (in.readn(s.data(), s.size()) != s.size())
+            throw std::runtime_error("truncated binlog");
+        return s;
+    }
+
+    void run(InStream &in, OutStream &out) {
+        char magic[sizeof(binlog::kMagic)];
+        if (in.readn(magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, binlog::kMagic, sizeof(magic)) != 0)
+            throw std::runtime_error("not a binlog file");
+        // 每个文件的编号各自独立
+        formats.clear();
+        char kind;
+        while (in.readn(&kind, 1) == 1) {
+            line.clear();
+            if (kind == 'F') {
+                uint32_t id = get_u32(in);
+                binlog::Format f;
+                f.line = get_u32(in);
+                f.file = get_str(in);
+                f.sig = get_str(in);
+                f.fmt = get_str(in);
+                if (id >= formats.size())
+                    formats.resize(id + 1);
+                formats[id] = std::move(f);
+            } else if (kind == 'R') {
+                uint32_t tid = get_u32(in);
+                rec.resize(binlog::kHeaderSize);
+                if (in.readn(rec.data(), rec.size()) != rec.size())
+                    throw std::runtime_error("truncated binlog");
+                uint32_t id = load_le32(rec.data());
+                uint32_t len = load_le32(rec.data() + 4);
+                if (len < binlog::kHeaderSize || id >= formats.size())
+                    throw std::runtime_error("corrupt binlog");
+                rec.resize(len);
+                if (in.readn(rec.data() + binlog::kHeaderSize, len - binlog::kHeaderSize) != len - binlog::kHeaderSize)
+                    throw std::runtime_error("truncated binlog");
+                text.line(line, formats[id], tid, load_le64(rec.data() + 8),
+                          rec.data() + binlog::kHeaderSize, len - binlog::kHeaderSize);
+            } else if (kind == 'D') {
+                uint32_t tid = get_u32(in);
+                char b[8];
+                if (in.readn(b, 8) != 8)
+                    throw std::runtime_error("truncated binlog");
+                text.dropped(line, tid, load_le64(b));
+            } else {
+                throw std::runtime_error("corrupt binlog");
+            }
+            out.write(line.data(), line.size());
+        }
+    }
+};
+
+int main(int argc, char **argv) {
+    if (getopt(argc, argv, "h") != -1)
+        usage();
+    try {
+        BufferedOutStream out(std::make_unique<UnixFileOutStream>(dup(STDOUT_FILENO)), BufferedOutStream::FullBuf, nullptr, 64 * 1024);
+        Decoder dec;
+        if (optind == argc) {
+            BufferedInStream in(std::make_unique<UnixFileInStream>(dup(STDIN_FILENO)), 64 * 1024);
+            dec.run(in, out);
+        }
+        for (int i = optind; i < argc; i++) {
+            BufferedInStream in(in_file_open(argv[i], OpenFlag::Read), 64 * 1024);
+            dec.run(in, out);
+        }
+    } catch (std::exception const &e) {
+        fprintf(stderr, "binlogcat: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
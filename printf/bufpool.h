@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstddef>
+#include <vector>
+#include <mutex>
+#include <sched.h>
+#include "hugepage.h"
+
+// 流的缓冲区池：打开关闭大量短命的流时，不用每次都 valloc/free，也不用每次重新缺页。
+// 大小按 4KiB 到 1MiB 的 2 的幂分级，拿到的都是页对齐的。
+// 每个线程先在自己的缓存里拿和还，缓存空了或者满了再成批地和全局池交换，大部分时候不加锁。
+// 全局池按 NUMA 节点分开：线程只和自己当前所在节点的池交换，
+// 缓冲区按首次访问分配在那个节点上，所以同一节点的线程拿到的一般是本地内存。
+// 超过最大一级的不进池，直接用 2MiB 大页映射（见 hugepage.h）。
+
+struct BufferPool {
+    static constexpr size_t kPageSize = 4096;
+    static constexpr size_t kNumClasses = 9;        // 4KiB, 8KiB, ..., 1MiB
+    static constexpr size_t kMaxNodes = 8;
+    static constexpr size_t kCacheBytes = 1 << 20;  // 每个线程每一级最多缓存这么多
+    static constexpr size_t kNodeBytes = 64 << 20;  // 每个节点每一级最多留这么多，多的还给系统
+
+private:
+    struct FreeList {
+        std::mutex mtx;
+        std::vector<char *> bufs;
+    };
+
+    FreeList lists[kMaxNodes][kNumClasses];
+
+    struct ThreadCache {
+        std::vector<char *> bufs[kNumClasses];
+
+        ~ThreadCache();
+    };
+
+    static inline thread_local ThreadCache *tcache = nullptr;
+    static inline thread_local bool tcache_gone = false;    // 线程退出时缓存已经交回去了
+
+    BufferPool() = default;
+
+    static size_t class_index(size_t size) {
+        size_t c = 0;
+        while ((kPageSize << c) < size)
+            ++c;
+        return c;
+    }
+
+    static size_t cache_limit(size_t c) {
+        size_t n = kCacheBytes / (kPageSize << c);
+        return n < 2 ? 2 : n;
+    }
+
+    static size_t current_node() {
+        unsigned cpu, node;
+        if (getcpu(&cpu, &node) < 0)
+            return 0;
+        return node % kMaxNodes;
+    }
+
+    static ThreadCache *thread_cache() {
+        if (tcache == nullptr && !tcache_gone) {
+            static thread_local ThreadCache holder;
+            tcache = &holder;
+        }
+        return tcache;
+    }
+
+    // 从本节点的池里最多拿 n 个
+    void take(size_t c, std::vector<char *> &to, size_t n) {
+        FreeList &l = lists[current_node()][c];
+        std::lock_guard<std::mutex> lock(l.mtx);
+        while (n-- != 0 && !l.bufs.empty()) {
+            to.push_back(l.bufs.back());
+            l.bufs.pop_back();
+        }
+    }
+
+    // 把 from 末尾的 n 个还到本节点的池里
+    void give(size_t c, std::vector<char *> &from, size_t n) {
+        FreeList &l = lists[current_node()][c];
+        size_t keep = kNodeBytes / (kPageSize << c);
+        std::lock_guard<std::mutex> lock(l.mtx);
+        while (n-- != 0) {
+            char *p = from.back();
+            from.pop_back();
+            if (l.bufs.size() < keep) {
+                l.bufs.push_back(p);
+            } else {
+                free(p);
+            }
+        }
+    }
+
+public:
+    // 进程结束时还有全局的流在析构，池本身故意不析构
+    static BufferPool &instance() {
+        static BufferPool *pool = new BufferPool;
+        return *pool;
+    }
+
+    // 实际拿到的大小，超过最大一级的取到 2MiB 的倍数
+    static size_t class_size(size_t size) {
+        if (size > (kPageSize << (kNumClasses - 1)))
+            return huge_round(size);
+        return kPageSize << class_index(size);
+    }
+
+    // backing 不为空时告诉调用者拿到的是哪种页
+    char *allocate(size_t size, PageBacking *backing = nullptr) {
+        PageBacking b = PageBacking::Normal;
+        if (backing == nullptr)
+            backing = &b;
+        if (size > (kPageSize << (kNumClasses - 1)))
+            return huge_alloc(size, *backing);
+        *backing = PageBacking::Normal;
+        size_t c = class_index(size);
+        ThreadCache *tc = thread_cache();
+        if (tc != nullptr) {
+            auto &v = tc->bufs[c];
+            if (v.empty())
+                take(c, v, cache_limit(c) / 2);
+            if (!v.empty()) {
+                char *p = v.back();
+                v.pop_back();
+                return p;
+            }
+        } else {
+            std::vector<char *> v;
+            take(c, v, 1);
+            if (!v.empty())
+                return v.back();
+        }
+        return (char *)aligned_alloc(kPageSize, kPageSize << c);
+    }
+
+    // size 要和 allocate 时传的一样（或者同一级）
+    void release(char *p, size_t size) {
+        if (p == nullptr)
+            return;
+        if (size > (kPageSize << (kNumClasses - 1))) {
+            huge_free(p, size);
+            return;
+        }
+        size_t c = class_index(size);
+        ThreadCache *tc = thread_cache();
+        if (tc == nullptr) {
+            std::vector<char *> v{p};
+            give(c, v, 1);
+            return;
+        }
+        auto &v = tc->bufs[c];
+        v.push_back(p);
+        if (v.size() > cache_limit(c))
+            give(c, v, v.size() / 2);
+    }
+
+    BufferPool(BufferPool &&) = delete;
+};
+
+inline BufferPool::ThreadCache::~ThreadCache() {
+    tcache = nullptr;
+    tcache_gone = true;
+    for (size_t c = 0; c < kNumClasses; c++) {
+        if (!bufs[c].empty())
+            instance().give(c, bufs[c], bufs[c].size());
+    }
+}
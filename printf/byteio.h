@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+// 小端定长整数读写，块格式的头部都用这个，和主机字节序无关
+
+inline void store_le32(char *p, uint32_t v) {
+    p[0] = (char)(v);
+    p[1] = (char)(v >> 8);
+    p[2] = (char)(v >> 16);
+    p[3] = (char)(v >> 24);
+}
+
+inline uint32_t load_le32(const char *p) {
+    const unsigned char *q = (const unsigned char *)p;
+    return (uint32_t)q[0] | ((uint32_t)q[1] << 8) | ((uint32_t)q[2] << 16) | ((uint32_t)q[3] << 24);
+}
+
+inline void store_le64(char *p, uint64_t v) {
+    store_le32(p, (uint32_t)v);
+    store_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+inline uint64_t load_le64(const char *p) {
+    return (uint64_t)load_le32(p) | ((uint64_t)load_le32(p + 4) << 32);
+}
+
+inline void store_le16(char *p, uint16_t v) {
+    p[0] = (char)(v);
+    p[1] = (char)(v >> 8);
+}
+
+inline uint16_t load_le16(const char *p) {
+    const unsigned char *q = (const unsigned char *)p;
+    return (uint16_t)(q[0] | (q[1] << 8));
+}
+
+// LEB128 变长整数，最多 10 字节
+constexpr size_t kMaxVarintSize = 10;
+
+inline size_t store_varint(char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+// 返回用掉的字节数，数据不完整或超长返回 0
+inline size_t load_varint(const char *p, size_t len, uint64_t &v) {
+    v = 0;
+    for (size_t i = 0; i < len && i < kMaxVarintSize; ++i) {
+        unsigned char b = (unsigned char)p[i];
+        v |= (uint64_t)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
@@ -0,0 +1,482 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <system_error>
+#include "stream.h"
+#include "byteio.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// 在 write/read 经过时顺手算校验和，数据还在缓存里，省掉事后再读一遍文件
+
+enum class ChecksumKind : uint8_t {
+    Crc32c = 1,
+    XxHash64 = 2,
+};
+
+namespace crc32c {
+
+struct Tables {
+    uint32_t t[8][256];
+
+    Tables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int k = 1; k < 8; ++k)
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+    }
+};
+
+inline Tables const &tables() {
+    static const Tables tab;
+    return tab;
+}
+
+// slicing-by-8：一次查 8 张表处理 8 字节
+inline uint32_t update_sw(uint32_t crc, const char *p, size_t n) {
+    auto const &t = tables().t;
+    const unsigned char *q = (const unsigned char *)p;
+    while (n >= 8) {
+        uint32_t lo = crc ^ load_le32((const char *)q);
+        uint32_t hi = load_le32((const char *)q + 4);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        q += 8;
+        n -= 8;
+    }
+    while (n--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *q++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t update_hw(uint32_t crc, const char *p, size_t n) {
+    uint64_t c = crc;
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        n -= 8;
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (n--)
+        c32 = _mm_crc32_u8(c32, (unsigned char)*p++);
+    return c32;
+}
+
+inline bool has_hw() {
+    static const bool ok = __builtin_cpu_supports("sse4.2");
+    return ok;
+}
+#endif
+
+// crc 是未取反的中间状态，初值 0xFFFFFFFF，最后取反
+inline uint32_t update(uint32_t crc, const char *p, size_t n) {
+#if defined(__x86_64__)
+    if (has_hw())
+        return update_hw(crc, p, n);
+#endif
+    return update_sw(crc, p, n);
+}
+
+}
+
+namespace xxh64 {
+
+constexpr uint64_t P1 = 11400714785074694791ull;
+constexpr uint64_t P2 = 14029467366897019727ull;
+constexpr uint64_t P3 = 1609587929392839161ull;
+constexpr uint64_t P4 = 9650029242287828579ull;
+constexpr uint64_t P5 = 2870177450012600261ull;
+
+inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t round(uint64_t acc, uint64_t v) {
+    acc += v * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+inline uint64_t merge(uint64_t acc, uint64_t v) {
+    acc ^= round(0, v);
+    return acc * P1 + P4;
+}
+
+// 流式 XXH64，每攒够 32 字节处理一条 stripe
+struct State {
+    uint64_t v[4];
+    uint64_t total = 0;
+    char mem[32];
+    size_t memsize = 0;
+    uint64_t seed;
+
+    explicit State(uint64_t seed_ = 0) : seed(seed_) {
+        v[0] = seed + P1 + P2;
+        v[1] = seed + P2;
+        v[2] = seed;
+        v[3] = seed - P1;
+    }
+
+    void stripe(const char *p) {
+        v[0] = round(v[0], load_le64(p));
+        v[1] = round(v[1], load_le64(p + 8));
+        v[2] = round(v[2], load_le64(p + 16));
+        v[3] = round(v[3], load_le64(p + 24));
+    }
+
+    void update(const char *p, size_t n) {
+        total += n;
+        if (memsize + n < 32) {
+            memcpy(mem + memsize, p, n);
+            memsize += n;
+            return;
+        }
+        if (memsize != 0) {
+            size_t k = 32 - memsize;
+            memcpy(mem + memsize, p, k);
+            stripe(mem);
+            p += k;
+            n -= k;
+            memsize = 0;
+        }
+        while (n >= 32) {
+            stripe(p);
+            p += 32;
+            n -= 32;
+        }
+        memcpy(mem, p, n);
+        memsize = n;
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total >= 32) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+            for (int i = 0; i < 4; ++i)
+                h = merge(h, v[i]);
+        } else {
+            h = seed + P5;
+        }
+        h += total;
+        const char *p = mem;
+        size_t n = memsize;
+        while (n >= 8) {
+            h ^= round(0, load_le64(p));
+            h = rotl(h, 27) * P1 + P4;
+            p += 8;
+            n -= 8;
+        }
+        if (n >= 4) {
+            h ^= (uint64_t)load_le32(p) * P1;
+            h = rotl(h, 23) * P2 + P3;
+            p += 4;
+            n -= 4;
+        }
+        while (n--) {
+            h ^= (unsigned char)*p++ * P5;
+            h = rotl(h, 11) * P1;
+        }
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+}
+
+struct Checksum {
+private:
+    ChecksumKind kind;
+    uint32_t crc = 0xFFFFFFFFu;
+    xxh64::State xx;
+
+public:
+    explicit Checksum(ChecksumKind kind_ = ChecksumKind::Crc32c) : kind(kind_) {
+    }
+
+    ChecksumKind get_kind() const {
+        return kind;
+    }
+
+    void update(const char *p, size_t n) {
+        if (kind == ChecksumKind::Crc32c)
+            crc = crc32c::update(crc, p, n);
+        else
+            xx.update(p, n);
+    }
+
+    // CRC32C 的结果放在低 32 位
+    uint64_t digest() const {
+        if (kind == ChecksumKind::Crc32c)
+            return ~crc;
+        return xx.digest();
+    }
+
+    void reset() {
+        crc = 0xFFFFFFFFu;
+        xx = xxh64::State();
+    }
+};
+
+inline uint64_t checksum(ChecksumKind kind, const char *p, size_t n) {
+    Checksum c(kind);
+    c.update(p, n);
+    return c.digest();
+}
+
+
+// None: 只在内存里算，自己用 digest() 取
+// Trailer: 流末尾追加 16 字节 [digest:u64][kind:u8]["CHKSUM\0"]
+// PerBlock: 每块 [len:u32] + 数据 + [digest:u64]，len == 0 的块之后跟整个流的 digest
+enum class ChecksumFraming {
+    None,
+    Trailer,
+    PerBlock,
+};
+
+constexpr size_t kChecksumTrailerSize = 16;
+constexpr char kChecksumMagic[7] = {'C', 'H', 'K', 'S', 'U', 'M', '\0'};
+
+struct ChecksummingOutStream : OutStream {
+private:
+    std::unique_ptr<OutStream> out;
+    ChecksumFraming framing;
+    Checksum total;
+    Checksum block_sum;
+    std::vector<char> block;
+    size_t block_size;
+    bool finished = false;
+
+    void emit_block() {
+        if (block.size() <= 4)
+            return;
+        size_t len = block.size() - 4;
+        block_sum.reset();
+        block_sum.update(block.data() + 4, len);
+        store_le32(block.data(), (uint32_t)len);
+        block.resize(block.size() + 8);
+        store_le64(block.data() + 4 + len, block_sum.digest());
+        out->write(block.data(), block.size());
+        block.resize(4);
+    }
+
+public:
+    explicit ChecksummingOutStream(std::unique_ptr<OutStream> out_,
+                                   ChecksumKind kind_ = ChecksumKind::Crc32c,
+                                   ChecksumFraming framing_ = ChecksumFraming::Trailer,
+                                   size_t block_size_ = 64 * 1024)
+        : out(std::move(out_))
+        , framing(framing_)
+        , total(kind_)
+        , block_sum(kind_)
+        , block_size(block_size_)
+    {
+        if (framing == ChecksumFraming::PerBlock) {
+            block.reserve(block_size + 12);
+            block.resize(4);    // 长度字段占位
+        }
+    }
+
+    void write(const char *__restrict s, size_t len) override {
+        total.update(s, len);
+        if (framing != ChecksumFraming::PerBlock) {
+            out->write(s, len);
+            return;
+        }
+        while (len != 0) {
+            size_t n = std::min(len, block_size + 4 - block.size());
+            block.insert(block.end(), s, s + n);
+            s += n;
+            len -= n;
+            if (block.size() == block_size + 4)
+                emit_block();
+        }
+    }
+
+    void flush() override {
+        if (framing == ChecksumFraming::PerBlock)
+            emit_block();
+        out->flush();
+    }
+
+    uint64_t digest() const {
+        return total.digest();
+    }
+
+    void finish() {
+        if (finished)
+            return;
+        finished = true;
+        char tail[kChecksumTrailerSize];
+        if (framing == ChecksumFraming::Trailer) {
+            store_le64(tail, total.digest());
+            tail[8] = (char)total.get_kind();
+            memcpy(tail + 9, kChecksumMagic, 7);
+            out->write(tail, kChecksumTrailerSize);
+        } else if (framing == ChecksumFraming::PerBlock) {
+            emit_block();
+            store_le32(tail, 0);
+            store_le64(tail + 4, total.digest());
+            out->write(tail, 12);
+        }
+        out->flush();
+    }
+
+    ChecksummingOutStream(ChecksummingOutStream &&) = delete;
+
+    ~ChecksummingOutStream() {
+        finish();
+    }
+};
+
+
+// 校验失败抛 EBADMSG。Trailer 模式要到读完才能发现错误，PerBlock 模式每块交出去之前就验过了
+struct VerifyingInStream : InStream {
+private:
+    std::unique_ptr<InStream> in;
+    ChecksumFraming framing;
+    Checksum total;
+    Checksum block_sum;
+    std::vector<char> buf;
+    size_t top = 0;
+    size_t max = 0;
+    size_t held = 0;
+    bool eof = false;
+    bool verified = false;
+
+    [[noreturn]] static void corrupt() {
+        throw std::system_error(EBADMSG, std::generic_category());
+    }
+
+    void check_trailer(const char *tail) {
+        if (memcmp(tail + 9, kChecksumMagic, 7) != 0 || (ChecksumKind)tail[8] != total.get_kind())
+            corrupt();
+        if (load_le64(tail) != total.digest())
+            corrupt();
+        verified = true;
+    }
+
+    // Trailer 模式：[max, max + held) 是扣住没交出去的 16 字节，读到 EOF 时它们就是尾部
+    [[nodiscard]] bool refill_trailer() {
+        memmove(buf.data(), buf.data() + max, held);
+        size_t have = held;
+        top = max = 0;
+        while (!eof && have <= kChecksumTrailerSize) {
+            size_t n = in->read(buf.data() + have, buf.size() - have);
+            if (n == 0)
+                eof = true;
+            have += n;
+        }
+        if (have < kChecksumTrailerSize)
+            corrupt();
+        max = have - kChecksumTrailerSize;
+        held = kChecksumTrailerSize;
+        total.update(buf.data(), max);
+        if (eof && !verified)
+            check_trailer(buf.data() + max);
+        return max != 0;
+    }
+
+    [[nodiscard]] bool refill_block() {
+        top = max = 0;
+        if (eof)
+            return false;
+        char hdr[12];
+        if (in->readn(hdr, 4) != 4)
+            corrupt();
+        size_t len = load_le32(hdr);
+        if (len == 0) {
+            if (in->readn(hdr + 4, 8) != 8 || load_le64(hdr + 4) != total.digest())
+                corrupt();
+            eof = verified = true;
+            return false;
+        }
+        if (buf.size() < len)
+            buf.resize(len);
+        if (in->readn(buf.data(), len) != len || in->readn(hdr + 4, 8) != 8)
+            corrupt();
+        block_sum.reset();
+        block_sum.update(buf.data(), len);
+        if (block_sum.digest() != load_le64(hdr + 4))
+            corrupt();
+        total.update(buf.data(), len);
+        max = len;
+        return true;
+    }
+
+    [[nodiscard]] bool refill() {
+        switch (framing) {
+        case ChecksumFraming::Trailer:
+            return refill_trailer();
+        case ChecksumFraming::PerBlock:
+            return refill_block();
+        default:
+            top = 0;
+            max = eof ? 0 : in->read(buf.data(), buf.size());
+            eof = max == 0;
+            total.update(buf.data(), max);
+            return max != 0;
+        }
+    }
+
+public:
+    explicit VerifyingInStream(std::unique_ptr<InStream> in_,
+                               ChecksumKind kind_ = ChecksumKind::Crc32c,
+                               ChecksumFraming framing_ = ChecksumFraming::Trailer)
+        : in(std::move(in_))
+        , framing(framing_)
+        , total(kind_)
+        , block_sum(kind_)
+        , buf(BUFSIZ)
+    {
+    }
+
+    int getchar() override {
+        if (top == max) {
+            if (!refill())
+                return EOF;
+        }
+        return (unsigned char)buf[top++];
+    }
+
+    size_t read(char *__restrict s, size_t len) override {
+        if (len == 0)
+            return 0;
+        if (top == max) {
+            if (!refill())
+                return 0;
+        }
+        size_t n = std::min(len, max - top);
+        memcpy(s, buf.data() + top, n);
+        top += n;
+        return n;
+    }
+
+    // 目前为止读到的数据的校验和
+    uint64_t digest() const {
+        return total.digest();
+    }
+
+    // 是否已经对上了文件里记录的校验和（None 模式下永远是 false）
+    bool is_verified() const {
+        return verified;
+    }
+
+    VerifyingInStream(VerifyingInStream &&) = delete;
+};
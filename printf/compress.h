@@ -0,0 +1,471 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <system_error>
+#include "stream.h"
+#include "byteio.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// 块格式：每块 [raw_len:u32][stored_len:u32][codec:u8] + stored_len 字节数据
+// raw_len == 0 的块表示流结束。压缩后不变小的块按 Store 原样存。
+
+enum class Codec : uint8_t {
+    Store = 0,
+    Lz = 1,     // 内置的 LZ4 风格编码，无依赖
+    Zlib = 2,
+    Zstd = 3,
+};
+
+constexpr size_t kBlockHeaderSize = 9;
+constexpr size_t kDefaultBlockSize = 64 * 1024;
+
+inline bool codec_available(Codec codec) {
+    switch (codec) {
+    case Codec::Store:
+    case Codec::Lz:
+        return true;
+    case Codec::Zlib:
+#ifdef HAVE_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    case Codec::Zstd:
+#ifdef HAVE_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+namespace lz {
+
+constexpr int kHashLog = 14;
+constexpr size_t kMinMatch = 4;
+constexpr size_t kMaxOffset = 65535;
+constexpr size_t kLastLiterals = 5;     // 和 LZ4 一样，末尾至少留 5 字节字面量
+constexpr size_t kMatchLimit = 12;      // 离结尾 12 字节内不再开始新匹配
+
+inline size_t bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+inline uint32_t hash4(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - kHashLog);
+}
+
+inline uint32_t load32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline char *put_length(char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = (char)255;
+        len -= 255;
+    }
+    *op++ = (char)len;
+    return op;
+}
+
+inline char *put_sequence(char *op, const char *lit, size_t nlit, size_t offset, size_t mlen) {
+    char *token = op++;
+    unsigned t = nlit >= 15 ? 15u : (unsigned)nlit;
+    if (nlit >= 15)
+        op = put_length(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0) {
+        // 最后一个序列只有字面量
+        *token = (char)(t << 4);
+        return op;
+    }
+    store_le16(op, (uint16_t)offset);
+    op += 2;
+    size_t m = mlen - kMinMatch;
+    *token = (char)((t << 4) | (m >= 15 ? 15u : (unsigned)m));
+    if (m >= 15)
+        op = put_length(op, m - 15);
+    return op;
+}
+
+// table 里存的是 位置+1，0 表示空槽
+inline size_t compress(const char *src, size_t n, char *dst, uint32_t *table) {
+    memset(table, 0, sizeof(uint32_t) << kHashLog);
+    char *op = dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+    if (n > kMatchLimit) {
+        size_t limit = n - kMatchLimit;
+        size_t match_end = n - kLastLiterals;
+        while (ip < limit) {
+            uint32_t seq = load32(src + ip);
+            uint32_t h = hash4(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)(ip + 1);
+            if (ref != 0 && ip - (ref - 1) <= kMaxOffset && load32(src + ref - 1) == seq) {
+                ref -= 1;
+                size_t mlen = kMinMatch;
+                while (ip + mlen < match_end && src[ref + mlen] == src[ip + mlen])
+                    ++mlen;
+                op = put_sequence(op, src + anchor, ip - anchor, ip - ref, mlen);
+                ip += mlen;
+                anchor = ip;
+            } else {
+                // 一直找不到匹配时加大步长，不可压缩的数据不至于太慢
+                ip += 1 + ((ip - anchor) >> 6);
+            }
+        }
+    }
+    op = put_sequence(op, src + anchor, n - anchor, 0, 0);
+    return op - dst;
+}
+
+inline bool get_length(const char *&ip, const char *end, size_t &len) {
+    unsigned char b;
+    do {
+        if (ip == end)
+            return false;
+        b = (unsigned char)*ip++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+inline bool decompress(const char *src, size_t n, char *dst, size_t rawlen) {
+    const char *ip = src;
+    const char *iend = src + n;
+    char *op = dst;
+    char *oend = dst + rawlen;
+    while (ip != iend) {
+        unsigned token = (unsigned char)*ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !get_length(ip, iend, nlit))
+            return false;
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+            return false;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return false;
+        size_t offset = load_le16(ip);
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !get_length(ip, iend, mlen))
+            return false;
+        mlen += kMinMatch;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < mlen)
+            return false;
+        const char *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            // 重叠拷贝，比如 offset == 1 是游程
+            for (size_t i = 0; i < mlen; ++i)
+                *op++ = *ref++;
+        }
+    }
+    return op == oend;
+}
+
+}
+
+// 每个压缩线程各自持有一个，LZ 的哈希表可以复用
+struct BlockCompressor {
+private:
+    Codec codec;
+    int level;
+    std::vector<uint32_t> table;
+
+public:
+    explicit BlockCompressor(Codec codec_ = Codec::Lz, int level_ = 0)
+        : codec(codec_)
+        , level(level_)
+    {
+        if (!codec_available(codec)) {
+            throw std::system_error(ENOTSUP, std::generic_category());
+        }
+        if (codec == Codec::Lz) {
+            table.resize(size_t(1) << lz::kHashLog);
+        }
+    }
+
+    Codec get_codec() const {
+        return codec;
+    }
+
+    size_t bound(size_t n) const {
+        switch (codec) {
+        case Codec::Lz:
+            return lz::bound(n);
+#ifdef HAVE_ZLIB
+        case Codec::Zlib:
+            return compressBound(n);
+#endif
+#ifdef HAVE_ZSTD
+        case Codec::Zstd:
+            return ZSTD_compressBound(n);
+#endif
+        default:
+            return n;
+        }
+    }
+
+    // 把 n 字节编码成一个完整的块（含头部）追加到 out 末尾
+    void encode_block(const char *src, size_t n, std::vector<char> &out) {
+        size_t base = out.size();
+        out.resize(base + kBlockHeaderSize + bound(n));
+        char *dst = out.data() + base + kBlockHeaderSize;
+        size_t stored = compress(src, n, dst, out.size() - base - kBlockHeaderSize);
+        Codec used = codec;
+        if (stored == 0 || stored >= n) {
+            memcpy(dst, src, n);
+            stored = n;
+            used = Codec::Store;
+        }
+        char *hdr = out.data() + base;
+        store_le32(hdr, (uint32_t)n);
+        store_le32(hdr + 4, (uint32_t)stored);
+        hdr[8] = (char)used;
+        out.resize(base + kBlockHeaderSize + stored);
+    }
+
+private:
+    // 返回 0 表示压缩失败，调用者退回 Store
+    size_t compress(const char *src, size_t n, char *dst, size_t cap) {
+        switch (codec) {
+        case Codec::Lz:
+            return lz::compress(src, n, dst, table.data());
+#ifdef HAVE_ZLIB
+        case Codec::Zlib: {
+            uLongf dlen = cap;
+            int lv = level == 0 ? Z_DEFAULT_COMPRESSION : level;
+            if (compress2((Bytef *)dst, &dlen, (const Bytef *)src, n, lv) != Z_OK)
+                return 0;
+            return dlen;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case Codec::Zstd: {
+            size_t r = ZSTD_compress(dst, cap, src, n, level == 0 ? 3 : level);
+            if (ZSTD_isError(r))
+                return 0;
+            return r;
+        }
+#endif
+        default:
+            (void)cap;
+            return 0;
+        }
+    }
+};
+
+inline void write_end_block(std::vector<char> &out) {
+    size_t base = out.size();
+    out.resize(base + kBlockHeaderSize);
+    memset(out.data() + base, 0, kBlockHeaderSize);
+}
+
+inline bool decode_block(Codec codec, const char *src, size_t n, char *dst, size_t rawlen) {
+    switch (codec) {
+    case Codec::Store:
+        if (n != rawlen)
+            return false;
+        memcpy(dst, src, n);
+        return true;
+    case Codec::Lz:
+        return lz::decompress(src, n, dst, rawlen);
+#ifdef HAVE_ZLIB
+    case Codec::Zlib: {
+        uLongf dlen = rawlen;
+        return uncompress((Bytef *)dst, &dlen, (const Bytef *)src, n) == Z_OK && dlen == rawlen;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case Codec::Zstd: {
+        size_t r = ZSTD_decompress(dst, rawlen, src, n);
+        return !ZSTD_isError(r) && r == rawlen;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+
+struct CompressingOutStream : OutStream {
+private:
+    std::unique_ptr<OutStream> out;
+    BlockCompressor comp;
+    std::vector<char> raw;
+    std::vector<char> block;
+    size_t block_size;
+    bool finished = false;
+
+    void emit_block() {
+        if (raw.empty())
+            return;
+        block.clear();
+        comp.encode_block(raw.data(), raw.size(), block);
+        out->write(block.data(), block.size());
+        raw.clear();
+    }
+
+public:
+    explicit CompressingOutStream(std::unique_ptr<OutStream> out_, Codec codec_ = Codec::Lz,
+                                  size_t block_size_ = kDefaultBlockSize, int level_ = 0)
+        : out(std::move(out_))
+        , comp(codec_, level_)
+        , block_size(block_size_)
+    {
+        raw.reserve(block_size);
+    }
+
+    void write(const char *__restrict s, size_t len) override {
+        while (len != 0) {
+            size_t n = std::min(len, block_size - raw.size());
+            raw.insert(raw.end(), s, s + n);
+            s += n;
+            len -= n;
+            if (raw.size() == block_size)
+                emit_block();
+        }
+    }
+
+    void putchar(char c) override {
+        raw.push_back(c);
+        if (raw.size() == block_size)
+            emit_block();
+    }
+
+    // 把不满的块也压出去，会让压缩率稍差
+    void flush() override {
+        emit_block();
+        out->flush();
+    }
+
+    // 写结束块，之后不能再写
+    void finish() {
+        if (finished)
+            return;
+        emit_block();
+        block.clear();
+        write_end_block(block);
+        out->write(block.data(), block.size());
+        out->flush();
+        finished = true;
+    }
+
+    CompressingOutStream(CompressingOutStream &&) = delete;
+
+    ~CompressingOutStream() {
+        finish();
+    }
+};
+
+
+struct DecompressingInStream : InStream {
+private:
+    std::unique_ptr<InStream> in;
+    std::vector<char> raw;
+    std::vector<char> stored;
+    size_t top = 0;
+    bool eof = false;
+
+    [[nodiscard]] bool next_block() {
+        while (!eof) {
+            char hdr[kBlockHeaderSize];
+            size_t n = in->readn(hdr, kBlockHeaderSize);
+            if (n == 0) {
+                // 没有结束块的流（比如被截断在块边界）也当作正常结束
+                eof = true;
+                break;
+            }
+            if (n != kBlockHeaderSize) {
+                throw std::system_error(EBADMSG, std::generic_category());
+            }
+            size_t rawlen = load_le32(hdr);
+            size_t storedlen = load_le32(hdr + 4);
+            Codec codec = (Codec)hdr[8];
+            if (rawlen == 0) {
+                eof = true;
+                break;
+            }
+            stored.resize(storedlen);
+            if (in->readn(stored.data(), storedlen) != storedlen) {
+                throw std::system_error(EBADMSG, std::generic_category());
+            }
+            raw.resize(rawlen);
+            if (!decode_block(codec, stored.data(), storedlen, raw.data(), rawlen)) {
+                throw std::system_error(EBADMSG, std::generic_category());
+            }
+            top = 0;
+            return true;
+        }
+        raw.clear();
+        top = 0;
+        return false;
+    }
+
+public:
+    explicit DecompressingInStream(std::unique_ptr<InStream> in_)
+        : in(std::move(in_))
+    {
+    }
+
+    int getchar() override {
+        if (top == raw.size()) {
+            if (!next_block())
+                return EOF;
+        }
+        return (unsigned char)raw[top++];
+    }
+
+    size_t read(char *__restrict s, size_t len) override {
+        if (len == 0)
+            return 0;
+        if (top == raw.size()) {
+            if (!next_block())
+                return 0;
+        }
+        size_t n = std::min(len, raw.size() - top);
+        memcpy(s, raw.data() + top, n);
+        top += n;
+        return n;
+    }
+
+    DecompressingInStream(DecompressingInStream &&) = delete;
+};
+
+
+inline std::unique_ptr<OutStream> out_file_open_compressed(const char *path, OpenFlag flag, Codec codec = Codec::Lz) {
+    int oflag = openFlagToUnixFlag.at(flag);
+    int fd = open(path, oflag, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    // 已经按块攒数据了，下面不需要再套 BufferedOutStream
+    auto file = std::make_unique<UnixFileOutStream>(fd);
+    return std::make_unique<CompressingOutStream>(std::move(file), codec);
+}
+
+inline std::unique_ptr<InStream> in_file_open_compressed(const char *path, OpenFlag flag) {
+    auto file = std::make_unique<BufferedInStream>(in_file_open(path, flag));
+    return std::make_unique<DecompressingInStream>(std::move(file));
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include "stream.h"
+#include "strview.h"
+#include "simd.h"
+
+// 直接在 BufferedInStream 的缓冲区上切字段，字段是指向缓冲区的 StrView，不拷贝。
+// 只有跨两次 refill 的行才拷到 carry 里拼起来。
+// 字段在下一次 next_row() 之前有效。引号字段里的 "" 原地改写成 "。
+// TSV 一般没有引号，传 quote = '\0' 关掉引号处理。
+
+struct CsvReader {
+private:
+    struct Span {
+        char *begin;
+        char *end;
+        bool quoted;
+        bool escaped;   // 带 "" 转义，需要原地压缩
+    };
+
+    std::unique_ptr<BufferedInStream> in;
+    char delim;
+    char quote;
+    std::string carry;
+    std::vector<Span> spans;
+    std::vector<StrView> fields;
+
+    // 在 [p, end) 里切出一行，成功返回这一行结束后的位置（跳过换行），行不完整返回 nullptr。
+    // eof 为 true 时 end 本身也算行尾。失败时不修改缓冲区，可以拿更多数据重来。
+    char *scan_row(char *p, char *end, bool eof) {
+        spans.clear();
+        char *f = p;
+        while (true) {
+            if (quote && f != end && *f == quote) {
+                char *q = f + 1;
+                bool escaped = false;
+                while (true) {
+                    q = simd::find_byte(q, end, quote);
+                    if (q == nullptr) {
+                        if (!eof)
+                            return nullptr;
+                        // 引号到 EOF 都没闭合，剩下的全算这个字段
+                        spans.push_back({f + 1, end, true, escaped});
+                        return end;
+                    }
+                    if (q + 1 == end && !eof)
+                        return nullptr;     // 还不知道是不是 ""
+                    if (q + 1 != end && q[1] == quote) {
+                        escaped = true;
+                        q += 2;
+                        continue;
+                    }
+                    break;
+                }
+                spans.push_back({f + 1, q, true, escaped});
+                f = q + 1;
+                // 闭合引号和分隔符之间多余的字符忽略掉
+                char *s = simd::find_any2(f, end, delim, '\n');
+                f = s ? s : end;
+            } else {
+                char *s = simd::find_any2(f, end, delim, '\n');
+                if (s == nullptr) {
+                    if (!eof)
+                        return nullptr;
+                    s = end;
+                }
+                spans.push_back({f, s, false, false});
+                f = s;
+            }
+            if (f == end) {
+                if (!eof)
+                    return nullptr;
+                trim_cr();
+                return end;
+            }
+            if (*f == delim) {
+                ++f;
+                continue;
+            }
+            trim_cr();
+            return f + 1;
+        }
+    }
+
+    // CRLF 行尾：去掉最后一个非引号字段末尾的 '\r'
+    void trim_cr() {
+        Span &s = spans.back();
+        if (!s.quoted && s.end != s.begin && s.end[-1] == '\r')
+            --s.end;
+    }
+
+    // 引号状态跨缓冲区延续，找不在引号里的换行
+    char *find_row_end(char *p, char *end, bool &in_quote) {
+        if (!quote)
+            return simd::find_byte(p, end, '\n');
+        while (true) {
+            char *s = simd::find_any2(p, end, quote, '\n');
+            if (s == nullptr)
+                return nullptr;
+            if (*s == quote) {
+                in_quote = !in_quote;
+            } else if (!in_quote) {
+                return s;
+            }
+            p = s + 1;
+        }
+    }
+
+    void finish_row() {
+        fields.clear();
+        for (auto &s: spans) {
+            if (s.escaped) {
+                char *w = s.begin;
+                for (char *r = s.begin; r != s.end; ++r) {
+                    *w++ = *r;
+                    if (*r == quote)
+                        ++r;    // "" 只留一个
+                }
+                s.end = w;
+            }
+            fields.emplace_back(s.begin, s.end - s.begin);
+        }
+    }
+
+public:
+    explicit CsvReader(std::unique_ptr<BufferedInStream> in_, char delim_ = ',', char quote_ = '"')
+        : in(std::move(in_))
+        , delim(delim_)
+        , quote(quote_)
+    {
+    }
+
+    // 读下一行，EOF 返回 false
+    bool next_row() {
+        carry.clear();
+        if (!in->fill())
+            return false;
+        char *p = in->buffer();
+        size_t n = in->buffered();
+        char *e = scan_row(p, p + n, false);
+        if (e != nullptr) {
+            in->consume(e - p);
+            finish_row();
+            return true;
+        }
+        // 慢路径：这一行跨过了缓冲区边界
+        bool in_quote = false;
+        e = find_row_end(p, p + n, in_quote);
+        carry.assign(p, e ? e - p : n);
+        in->consume(e ? e + 1 - p : n);
+        while (e == nullptr && in->fill()) {
+            p = in->buffer();
+            n = in->buffered();
+            e = find_row_end(p, p + n, in_quote);
+            if (e != nullptr) {
+                carry.append(p, e - p);
+                in->consume(e + 1 - p);
+                break;
+            }
+            carry.append(p, n);
+            in->consume(n);
+        }
+        char *c = &carry[0];
+        scan_row(c, c + carry.size(), true);
+        finish_row();
+        return true;
+    }
+
+    size_t size() const {
+        return fields.size();
+    }
+
+    StrView operator[](size_t i) const {
+        return fields[i];
+    }
+
+    std::vector<StrView> const &row() const {
+        return fields;
+    }
+
+    CsvReader(CsvReader &&) = delete;
+};
@@ -0,0 +1,390 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "stream.h"
+#include "merge.h"
+
+// 外部排序：和 LC_ALL=C sort 一样按字节序排行，输入可以比内存大。
+// 1. 按内存预算把输入切成若干段，每段在内存里用并行采样排序排好，写成临时文件（run）
+// 2. 用 MergedLineStream 多路归并所有 run；run 太多时先分组归并成更少的 run
+// 整个输入放得进内存时不落盘，直接排好输出。
+// 读写缓冲区、行的内容、行索引、排序用的临时空间、归并时的预读缓冲区都算在内存预算里，
+// 排序阶段的内存在归并开始之前还掉。
+//
+// 用法：extsort [-m 内存MiB] [-j 线程数] [-T 临时目录] [-o 输出文件] [输入文件...]
+// 没有输入文件时读 stdin，没有 -o 时写 stdout，统计信息打印到 stderr。
+
+struct Line {
+    uint64_t key;       // 前 8 个字节按大端拼成的整数，大部分比较到这里就能分出大小
+    const char *p;
+    size_t len;
+};
+
+static uint64_t make_key(const char *p, size_t len) {
+    unsigned char b[8] = {};
+    memcpy(b, p, std::min<size_t>(len, 8));
+    uint64_t k;
+    memcpy(&k, b, 8);
+    return __builtin_bswap64(k);
+}
+
+static bool line_less(Line const &a, Line const &b) {
+    if (a.key != b.key)
+        return a.key < b.key;
+    // key 相等说明前 min(8, 长度) 个字节都相等（"a" 和 "a\0" 的 key 也相等，所以还要比长度）
+    size_t skip = std::min<size_t>({a.len, b.len, 8});
+    return StrView(a.p + skip, a.len - skip) < StrView(b.p + skip, b.len - skip);
+}
+
+template <class F>
+static void run_threads(unsigned n, F const &f) {
+    std::vector<std::thread> ts;
+    for (unsigned t = 1; t < n; t++)
+        ts.emplace_back(f, t);
+    f(0);
+    for (auto &t: ts)
+        t.join();
+}
+
+// 采样排序：抽样选出 nthreads - 1 个分割点，按分割点把行分到各个桶里，桶之间已经有序，
+// 每个桶再各自排序。分桶和桶内排序都是并行的。tmp 是和 lines 一样大的临时空间
+static void parallel_sort(std::vector<Line> &lines, std::vector<Line> &tmp, unsigned nthreads) {
+    size_t n = lines.size();
+    if (nthreads <= 1 || n < 65536) {
+        std::sort(lines.begin(), lines.end(), line_less);
+        return;
+    }
+    const size_t over = 64;
+    std::vector<Line> samples;
+    for (size_t i = 0; i < nthreads * over; i++)
+        samples.push_back(lines[i * n / (nthreads * over)]);
+    std::sort(samples.begin(), samples.end(), line_less);
+    std::vector<Line> splitters;
+    for (unsigned b = 1; b < nthreads; b++)
+        splitters.push_back(samples[b * over]);
+
+    unsigned nb = nthreads;
+    std::vector<uint32_t> bucket(n);
+    std::vector<std::vector<size_t>> counts(nthreads, std::vector<size_t>(nb));
+    run_threads(nthreads, [&](unsigned t) {
+        for (size_t i = n * t / nthreads; i < n * (t + 1) / nthreads; i++) {
+            auto it = std::upper_bound(splitters.begin(), splitters.end(), lines[i], line_less);
+            bucket[i] = it - splitters.begin();
+            counts[t][bucket[i]]++;
+        }
+    });
+    // 每个线程在每个桶里的起始位置
+    std::vector<size_t> starts(nb + 1);
+    size_t pos = 0;
+    for (unsigned b = 0; b < nb; b++) {
+        starts[b] = pos;
+        for (unsigned t = 0; t < nthreads; t++) {
+            size_t c = counts[t][b];
+            counts[t][b] = pos;
+            pos += c;
+        }
+    }
+    starts[nb] = pos;
+    tmp.resize(n);
+    run_threads(nthreads, [&](unsigned t) {
+        for (size_t i = n * t / nthreads; i < n * (t + 1) / nthreads; i++)
+            tmp[counts[t][bucket[i]]++] = lines[i];
+    });
+    // 桶的大小可能很不均匀（比如大量重复行），谁空了谁去领下一个
+    std::atomic<unsigned> next{0};
+    run_threads(nthreads, [&](unsigned) {
+        unsigned b;
+        while ((b = next++) < nb)
+            std::sort(tmp.begin() + starts[b], tmp.begin() + starts[b + 1], line_less);
+    });
+    lines.swap(tmp);
+}
+
+struct Options {
+    size_t mem = 1024 << 20;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string tmpdir = "/tmp";
+    const char *output = nullptr;
+    std::vector<const char *> inputs;
+};
+
+static void usage() {
+    fprintf(stderr, "usage: extsort [-m MiB] [-j threads] [-T tmpdir] [-o output] [file...]\n");
+    exit(2);
+}
+
+struct Stats {
+    size_t bytes = 0;
+    size_t lines = 0;
+    size_t runs = 0;
+    size_t merge_passes = 0;
+};
+
+struct ExternalSorter {
+private:
+    Options const &opt;
+    Stats &stats;
+    char *arena = nullptr;
+    size_t cap;
+    size_t io_buf;              // 每一个读写缓冲区的大小
+    size_t used = 0;
+    size_t line_start = 0;      // 还没有结束的那一行从哪里开始
+    size_t max_lines;
+    std::vector<Line> lines;
+    std::vector<Line> tmp;
+    std::vector<std::string> runs;  // 还没删掉的临时文件，删掉的位置清空
+    size_t fan_in;
+    size_t merge_buf;
+
+    static constexpr size_t kMaxFanIn = 128;
+    static constexpr size_t kMinMergeBuf = 64 * 1024;
+
+    std::unique_ptr<BufferedOutStream> create_run(std::string &path) {
+        path = opt.tmpdir + "/extsort.XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        return std::make_unique<BufferedOutStream>(std::make_unique<UnixFileOutStream>(fd),
+                                                   BufferedOutStream::FullBuf, nullptr, io_buf);
+    }
+
+    // 打开之后马上删掉，读完关闭时空间自动释放，中途退出也不会留下临时文件。
+    // 删掉后把 path 清空，析构时不会再去删一个别人后来用同样名字建的文件
+    static std::unique_ptr<InStream> open_run(std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        unlink(path.c_str());
+        path.clear();
+        return std::make_unique<UnixFileInStream>(fd);
+    }
+
+    void add_line(size_t begin, size_t end) {
+        const char *p = arena + begin;
+        lines.push_back({make_key(p, end - begin), p, end - begin});
+        ++stats.lines;
+    }
+
+    void write_lines(OutStream &out) {
+        for (auto &l: lines) {
+            out.write(l.p, l.len);
+            out.putchar('\n');
+        }
+    }
+
+    // 排好当前这一段写成 run，再把没读完的半行挪到 arena 开头
+    void spill() {
+        parallel_sort(lines, tmp, opt.threads);
+        // 先记下名字再写，写到一半出错时析构也能删掉
+        runs.emplace_back();
+        {
+            auto out = create_run(runs.back());
+            write_lines(*out);
+        }
+        ++stats.runs;
+        lines.clear();
+        memmove(arena, arena + line_start, used - line_start);
+        used -= line_start;
+        line_start = 0;
+    }
+
+    void read_input(std::unique_ptr<InStream> raw) {
+        BufferedInStream in(std::move(raw), io_buf);
+        while (in.fill()) {
+            if (used == cap) {
+                if (line_start == 0) {
+                    throw std::system_error(EFBIG, std::generic_category(), "line longer than memory budget");
+                }
+                spill();
+                continue;
+            }
+            size_t m = std::min(in.buffered(), cap - used);
+            memcpy(arena + used, in.buffer(), m);
+            in.consume(m);
+            stats.bytes += m;
+            size_t scan = used;
+            used += m;
+            while (scan < used) {
+                const char *q = (const char *)memchr(arena + scan, '\n', used - scan);
+                if (q == nullptr)
+                    break;
+                size_t end = q - arena;
+                add_line(line_start, end);
+                line_start = end + 1;
+                scan = end + 1;
+                if (lines.size() == max_lines) {
+                    size_t removed = line_start;
+                    spill();
+                    scan -= removed;
+                }
+            }
+        }
+        // 最后一行没有换行也算一行
+        if (line_start != used) {
+            add_line(line_start, used);
+            line_start = used;
+            if (lines.size() == max_lines)
+                spill();
+        }
+    }
+
+    // runs 太多时先分组归并，直到一次就能归并完
+    // 新的 run 接在 runs 后面，这一轮的都归并完之后再把前面的去掉
+    void reduce_runs() {
+        while (runs.size() > fan_in) {
+            ++stats.merge_passes;
+            size_t n = runs.size();
+            for (size_t i = 0; i < n; i += fan_in) {
+                size_t e = std::min(n, i + fan_in);
+                runs.emplace_back();
+                auto out = create_run(runs.back());
+                merge_into(i, e, *out);
+            }
+            runs.erase(runs.begin(), runs.begin() + n);
+        }
+    }
+
+    // 归并 runs[b, e)，每一路两个 merge_buf 大小的预读缓冲区。
+    // 每次都用同样大小的缓冲区，还回 BufferPool 的下一次能直接用上
+    void merge_into(size_t b, size_t e, OutStream &out) {
+        std::vector<std::unique_ptr<InStream>> ins;
+        for (size_t i = b; i != e; ++i)
+            ins.push_back(open_run(runs[i]));
+        MergedLineStream m(std::move(ins), merge_buf);
+        for (StrView l: m) {
+            out.write(l.data(), l.size());
+            out.putchar('\n');
+        }
+    }
+
+    // 排序阶段用完的内存还掉，留给归并
+    void release_sort_memory() {
+        BufferPool::instance().release(arena, cap);
+        arena = nullptr;
+        std::vector<Line>().swap(lines);
+        std::vector<Line>().swap(tmp);
+    }
+
+public:
+    ExternalSorter(Options const &opt_, Stats &stats_)
+        : opt(opt_)
+        , stats(stats_)
+    {
+        // 排序阶段同时有一个读缓冲区和一个写 run 的缓冲区；
+        // 剩下的一半给行的内容，一半给两份行索引（排序时要一份临时空间）和每行一个桶号
+        io_buf = std::clamp<size_t>(opt.mem / 16, 64 * 1024, 4 << 20);
+        size_t avail = opt.mem - 2 * io_buf;
+        cap = avail / 2;
+        max_lines = std::max<size_t>(avail / 2 / (2 * sizeof(Line) + sizeof(uint32_t)), 1);
+        // 归并阶段除了一个输出缓冲区，剩下的都给各路的预读缓冲区，每一路两个
+        size_t merge_mem = opt.mem - io_buf;
+        fan_in = std::clamp<size_t>(merge_mem / (2 * kMinMergeBuf), 2, kMaxFanIn);
+        merge_buf = std::clamp<size_t>(merge_mem / (2 * fan_in), kMinMergeBuf, 1 << 20);
+        arena = BufferPool::instance().allocate(cap);
+        lines.reserve(max_lines);
+    }
+
+    // 输出缓冲区应该用的大小
+    size_t io_buffer_size() const {
+        return io_buf;
+    }
+
+    void add(std::unique_ptr<InStream> in) {
+        read_input(std::move(in));
+    }
+
+    void finish(OutStream &out) {
+        if (runs.empty()) {
+            // 全部在内存里
+            parallel_sort(lines, tmp, opt.threads);
+            write_lines(out);
+            return;
+        }
+        if (!lines.empty())
+            spill();
+        release_sort_memory();
+        reduce_runs();
+        merge_into(0, runs.size(), out);
+    }
+
+    ExternalSorter(ExternalSorter &&) = delete;
+
+    ~ExternalSorter() {
+        BufferPool::instance().release(arena, cap);
+        for (auto &r: runs)
+            if (!r.empty())
+                unlink(r.c_str());
+    }
+};
+
+int main(int argc, char **argv) {
+    Options opt;
+    int c;
+    while ((c = getopt(argc, argv, "m:j:T:o:h")) != -1) {
+        switch (c) {
+        case 'm':
+            opt.mem = (size_t)atoll(optarg) << 20;
+            break;
+        case 'j':
+            opt.threads = std::max(1, atoi(optarg));
+            break;
+        case 'T':
+            opt.tmpdir = optarg;
+            break;
+        case 'o':
+            opt.output = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (opt.mem < (4 << 20))
+        opt.mem = 4 << 20;
+    for (int i = optind; i < argc; i++)
+        opt.inputs.push_back(argv[i]);
+
+    auto t0 = std::chrono::steady_clock::now();
+    Stats stats;
+    try {
+        ExternalSorter sorter(opt, stats);
+        if (opt.inputs.empty()) {
+            sorter.add(std::make_unique<UnixFileInStream>(dup(STDIN_FILENO)));
+        }
+        for (const char *path: opt.inputs) {
+            sorter.add(in_file_open(path, OpenFlag::Read));
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        int fd = opt.output ? open(opt.output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : dup(STDOUT_FILENO);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), opt.output);
+        }
+        {
+            BufferedOutStream out(std::make_unique<UnixFileOutStream>(fd), BufferedOutStream::FullBuf, nullptr, sorter.io_buffer_size());
+            sorter.finish(out);
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        double read_s = std::chrono::duration<double>(t1 - t0).count();
+        double total_s = std::chrono::duration<double>(t2 - t0).count();
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        fprintf(stderr, "extsort: %zu bytes, %zu lines, %zu runs, %zu extra merge passes, %u threads\n",
+                stats.bytes, stats.lines, stats.runs, stats.merge_passes, opt.threads);
+        fprintf(stderr, "extsort: read+sort+spill %.3fs, total %.3fs, %.1f MB/s, peak rss %ld MiB (budget %zu MiB)\n",
+                read_s, total_s, total_s > 0 ? stats.bytes / total_s / 1e6 : 0.0, ru.ru_maxrss / 1024, opt.mem >> 20);
+    } catch (std::exception const &e) {
+        fprintf(stderr, "extsort: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
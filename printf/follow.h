@@ -0,0 +1,190 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <system_error>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include "stream.h"
+
+// tail -F：读到结尾不返回 0，而是等 inotify 通知有新数据再接着读。
+// 除了文件本身，还盯着它所在的目录，这样日志被轮转（改名后新建一个同名文件）时能发现：
+// 读完旧文件剩下的数据后，路径指向的 inode 变了就切到新文件从头读。
+// 文件被截短（copytruncate）时从头读。
+//
+// read 只有在 stop() 之后，或者设了 idle_ms 且这么久都没有新数据时才返回 0，
+// 所以 getline / readall 会一直等下去，而不是读到当前结尾就结束。
+
+struct FollowingInStream : InStream {
+private:
+    std::string path;
+    std::string name;               // path 的最后一段，用来过滤目录里别的文件的事件
+    std::unique_ptr<UnixFileInStream> file;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    off_t pos = 0;                  // 在当前文件里读到哪了
+    int ino_fd = -1;
+    int file_wd = -1;
+    int stop_fd = -1;
+    int idle_ms;
+    uint64_t rotations = 0;
+    uint64_t truncations = 0;
+
+    // 打开 path 并开始盯着它；文件不存在返回 false
+    bool open_file() {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ENOENT)
+                return false;
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            int saved = errno;
+            ::close(fd);
+            throw std::system_error(saved, std::generic_category(), path);
+        }
+        if (file_wd >= 0)
+            inotify_rm_watch(ino_fd, file_wd);
+        file_wd = inotify_add_watch(ino_fd, path.c_str(), IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+        file = std::make_unique<UnixFileInStream>(fd);
+        dev = st.st_dev;
+        ino = st.st_ino;
+        pos = 0;
+        return true;
+    }
+
+    // 等到有事件（返回 true），或者被 stop / 超时（返回 false）
+    bool wait_events() {
+        pollfd fds[2] = {{ino_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+        while (true) {
+            int r = ::poll(fds, 2, idle_ms);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category());
+            }
+            if (r == 0 || (fds[1].revents & POLLIN))
+                return false;
+            // 事件本身不重要，醒过来重新看一遍文件；目录里别的文件的事件不算
+            alignas(inotify_event) char buf[4096];
+            bool relevant = false;
+            ssize_t n;
+            while ((n = ::read(ino_fd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + n;) {
+                    auto *ev = (inotify_event *)p;
+                    // wd 为 -1 是事件队列溢出了，丢了什么不知道，也得重新看
+                    if (ev->wd == file_wd || ev->wd == -1 || (ev->len != 0 && name == ev->name))
+                        relevant = true;
+                    p += sizeof(inotify_event) + ev->len;
+                }
+            }
+            if (n < 0 && errno != EAGAIN && errno != EINTR)
+                throw std::system_error(errno, std::generic_category());
+            if (relevant)
+                return true;
+        }
+    }
+
+    // 路径现在指向的还是不是我们打开的那个文件
+    bool replaced() const {
+        struct stat st;
+        if (stat(path.c_str(), &st) < 0)
+            return false;   // 旧的改名走了、新的还没建出来，先接着等
+        return st.st_ino != ino || st.st_dev != dev;
+    }
+
+public:
+    // from_end 为 true 时从当前结尾开始读（tail -f 的默认行为），否则从头读。
+    // idle_ms 为 -1 时一直等；否则这么久没有新数据 read 就返回 0
+    explicit FollowingInStream(std::string path_, bool from_end = false, int idle_ms_ = -1)
+        : path(std::move(path_))
+        , idle_ms(idle_ms_)
+    {
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        name = slash == std::string::npos ? path : path.substr(slash + 1);
+        ino_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ino_fd < 0) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (stop_fd < 0 || inotify_add_watch(ino_fd, dir.c_str(), IN_CREATE | IN_MOVED_TO) < 0) {
+            int saved = errno;
+            ::close(ino_fd);
+            if (stop_fd >= 0)
+                ::close(stop_fd);
+            throw std::system_error(saved, std::generic_category(), dir);
+        }
+        try {
+            if (!open_file()) {
+                throw std::system_error(ENOENT, std::generic_category(), path);
+            }
+            if (from_end)
+                pos = file->seek(0, SEEK_END);
+        } catch (...) {
+            ::close(ino_fd);
+            ::close(stop_fd);
+            throw;
+        }
+    }
+
+    size_t read(char *__restrict s, size_t len) override {
+        if (len == 0)
+            return 0;
+        while (true) {
+            IoResult r = file->try_read(s, len);
+            if (r.n != 0) {
+                pos += r.n;
+                return r.n;
+            }
+            // 到了结尾：先看是不是被截短了
+            struct stat st;
+            if (fstat(file->get_fd(), &st) == 0 && st.st_size < pos) {
+                pos = file->seek(0);
+                ++truncations;
+                continue;
+            }
+            // 再看是不是被轮转了；旧文件最后写进来的数据要先读完
+            if (replaced()) {
+                r = file->try_read(s, len);
+                if (r.n != 0) {
+                    pos += r.n;
+                    return r.n;
+                }
+                if (open_file()) {
+                    ++rotations;
+                    continue;
+                }
+            }
+            if (!wait_events())
+                return 0;
+        }
+    }
+
+    // 让正在等待（或者以后要等待）的 read 返回 0，可以从别的线程调用
+    void stop() {
+        uint64_t one = 1;
+        (void)::write(stop_fd, &one, sizeof(one));
+    }
+
+    // 切换到新文件的次数
+    uint64_t rotation_count() const {
+        return rotations;
+    }
+
+    // 发现被截短、从头重读的次数
+    uint64_t truncation_count() const {
+        return truncations;
+    }
+
+    FollowingInStream(FollowingInStream &&) = delete;
+
+    ~FollowingInStream() {
+        ::close(ino_fd);
+        ::close(stop_fd);
+    }
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <system_error>
+#include <sys/mman.h>
+
+// MiB 级别的大缓冲区用 2MiB 大页：顺序扫过去 TLB 不再一页一页地缺，缺页次数也少 512 倍。
+// 先试 MAP_HUGETLB（需要预留了大页池），不行就按 2MiB 对齐 mmap 普通内存再 madvise(MADV_HUGEPAGE)
+// 交给透明大页，都不行就是普通的 4KiB 页。拿到的是哪一种会告诉调用者。
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+enum class PageBacking {
+    Normal,
+    TransparentHuge,    // madvise 成功了，内核有空闲的 2MiB 连续物理页时才真的合并
+    HugeTlb,
+};
+
+inline const char *page_backing_name(PageBacking b) {
+    switch (b) {
+    case PageBacking::HugeTlb:
+        return "hugetlb";
+    case PageBacking::TransparentHuge:
+        return "thp";
+    default:
+        return "normal";
+    }
+}
+
+constexpr size_t kHugePageSize = 2 << 20;
+
+inline size_t huge_round(size_t size) {
+    return (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+}
+
+// 对已有的映射请求透明大页
+inline PageBacking advise_huge(void *p, size_t len) {
+#ifdef MADV_HUGEPAGE
+    if (madvise(p, len, MADV_HUGEPAGE) == 0)
+        return PageBacking::TransparentHuge;
+#endif
+    return PageBacking::Normal;
+}
+
+// 大小向上取到 2MiB 的倍数，用 huge_free 释放
+inline char *huge_alloc(size_t size, PageBacking &backing) {
+    size = huge_round(size);
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (p != MAP_FAILED) {
+        backing = PageBacking::HugeTlb;
+        return (char *)p;
+    }
+    // 多映射 2MiB 再把两头切掉，得到 2MiB 对齐的一段，透明大页才能整块地用上
+    size_t span = size + kHugePageSize;
+    p = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    uintptr_t base = (uintptr_t)p;
+    uintptr_t aligned = (base + kHugePageSize - 1) & ~(uintptr_t)(kHugePageSize - 1);
+    if (aligned != base)
+        munmap(p, aligned - base);
+    if (aligned + size != base + span)
+        munmap((void *)(aligned + size), base + span - (aligned + size));
+    backing = advise_huge((void *)aligned, size);
+    return (char *)aligned;
+}
+
+inline void huge_free(char *p, size_t size) {
+    if (p != nullptr)
+        munmap(p, huge_round(size));
+}
+
+// 从 /proc/self/smaps 里查 p 所在的映射实际有多少字节落在大页上（hugetlb 的按映射大小算），
+// 用来确认透明大页到底有没有生效
+inline size_t huge_resident_bytes(const void *p) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == nullptr)
+        return 0;
+    uintptr_t addr = (uintptr_t)p;
+    char line[512];
+    bool inside = false;
+    size_t bytes = 0;
+    while (fgets(line, sizeof(line), f)) {
+        // 每个映射以 "起始-结束 权限 ..." 这样一行开头，后面跟着 "字段: 值" 的若干行
+        unsigned long lo, hi;
+        size_t h = strspn(line, "0123456789abcdef");
+        if (h != 0 && line[h] == '-' && sscanf(line, "%lx-%lx", &lo, &hi) == 2) {
+            if (inside)
+                break;
+            inside = addr >= lo && addr < hi;
+            continue;
+        }
+        if (!inside)
+            continue;
+        unsigned long kb;
+        if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1
+                || sscanf(line, "FilePmdMapped: %lu kB", &kb) == 1
+                || sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1
+                || sscanf(line, "Shared_Hugetlb: %lu kB", &kb) == 1) {
+            bytes += kb * 1024;
+        }
+    }
+    fclose(f);
+    return bytes;
+}
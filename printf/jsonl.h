@@ -0,0 +1,552 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+#include "stream.h"
+#include "strview.h"
+#include "simd.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// NDJSON 逐行读取。next() 只用 memchr 找换行，第一次访问字段时才建结构索引：
+// 仿照 simdjson 的第一阶段，每 64 字节用向量比较得到 引号/反斜杠/结构字符 的位掩码，
+// 算出哪些字节在字符串里，剩下的 {}[]:, 和未转义的引号位置记到索引里。
+// 之后按索引跳着找字段，只有真正取值的字段才会解码（反转义、strtod）。
+// 视图都指向 BufferedInStream 的缓冲区，在下一次 next() 之前有效。
+
+namespace jsonidx {
+
+// 64 字节 -> 64 位掩码，第 i 位表示 p[i] == c
+struct Block {
+#if defined(__x86_64__)
+    __m128i v[4];
+
+    explicit Block(const char *p) {
+        for (int i = 0; i < 4; ++i)
+            v[i] = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+    }
+
+    uint64_t eq(char c) const {
+        __m128i vc = _mm_set1_epi8(c);
+        uint64_t m = 0;
+        for (int i = 0; i < 4; ++i)
+            m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], vc)) << (16 * i);
+        return m;
+    }
+#else
+    const char *p;
+
+    explicit Block(const char *p_) : p(p_) {
+    }
+
+    uint64_t eq(char c) const {
+        uint64_t m = 0;
+        for (int i = 0; i < 64; ++i)
+            m |= (uint64_t)(p[i] == c) << i;
+        return m;
+    }
+#endif
+};
+
+#if defined(__x86_64__)
+struct BlockAvx2 {
+    __m256i lo, hi;
+
+    __attribute__((target("avx2")))
+    explicit BlockAvx2(const char *p) {
+        lo = _mm256_loadu_si256((const __m256i *)p);
+        hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    }
+
+    __attribute__((target("avx2")))
+    uint64_t eq(char c) const {
+        __m256i vc = _mm256_set1_epi8(c);
+        uint64_t a = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vc));
+        uint64_t b = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vc));
+        return a | (b << 32);
+    }
+};
+#endif
+
+inline uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// 跨块延续的状态
+struct State {
+    uint64_t prev_odd_backslash = 0;
+    uint64_t prev_in_string = 0;
+};
+
+// 被奇数个连续反斜杠转义的字符位置（simdjson 的 find_odd_backslash_sequences）
+inline uint64_t escaped_chars(uint64_t bs, State &st) {
+    const uint64_t even_bits = 0x5555555555555555ull;
+    const uint64_t odd_bits = ~even_bits;
+    uint64_t start_edges = bs & ~(bs << 1);
+    uint64_t even_start_mask = even_bits ^ st.prev_odd_backslash;
+    uint64_t even_starts = start_edges & even_start_mask;
+    uint64_t odd_starts = start_edges & ~even_start_mask;
+    uint64_t even_carries = bs + even_starts;
+    uint64_t odd_carries = bs + odd_starts;
+    bool overflow = odd_carries < bs;
+    odd_carries |= st.prev_odd_backslash;
+    st.prev_odd_backslash = overflow ? 1 : 0;
+    uint64_t even_carry_ends = even_carries & ~bs;
+    uint64_t odd_carry_ends = odd_carries & ~bs;
+    return (even_carry_ends & odd_bits) | (odd_carry_ends & even_bits);
+}
+
+// 由一块的 反斜杠/引号/{}[]:, 掩码得出结构字符的位置
+inline uint64_t structurals(uint64_t bs, uint64_t quote, uint64_t ops, State &st) {
+    uint64_t quotes = quote & ~escaped_chars(bs, st);
+    uint64_t in_string = prefix_xor(quotes) ^ st.prev_in_string;
+    st.prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+    return (ops & ~in_string) | quotes;
+}
+
+template <class B>
+inline uint64_t structurals(B const &b, State &st) {
+    uint64_t ops = b.eq('{') | b.eq('}') | b.eq('[') | b.eq(']') | b.eq(':') | b.eq(',');
+    return structurals(b.eq('\\'), b.eq('"'), ops, st);
+}
+
+inline void flatten(uint64_t m, uint32_t base, std::vector<uint32_t> &out) {
+    while (m != 0) {
+        out.push_back(base + (uint32_t)__builtin_ctzll(m));
+        m &= m - 1;
+    }
+}
+
+// 尾巴拷到补了空格的 64 字节里
+inline void pad_tail(const char *p, size_t n, char (&tail)[64]) {
+    memset(tail, ' ', sizeof tail);
+    memcpy(tail, p, n);
+}
+
+template <class B>
+inline void build_generic(const char *p, size_t n, std::vector<uint32_t> &out) {
+    State st;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+        flatten(structurals(B(p + i), st), (uint32_t)i, out);
+    if (i != n) {
+        char tail[64];
+        pad_tail(p + i, n - i, tail);
+        flatten(structurals(B(tail), st), (uint32_t)i, out);
+    }
+}
+
+#if defined(__x86_64__)
+// 不能借 build_generic<BlockAvx2>：没有 avx2 属性的函数里 BlockAvx2 的成员内联不进来，每块都是函数调用。
+// 循环和取掩码都写在带 avx2 属性的函数里
+__attribute__((target("avx2")))
+inline uint64_t structurals_avx2(const char *p, State &st) {
+    BlockAvx2 b(p);
+    uint64_t ops = b.eq('{') | b.eq('}') | b.eq('[') | b.eq(']') | b.eq(':') | b.eq(',');
+    return structurals(b.eq('\\'), b.eq('"'), ops, st);
+}
+
+__attribute__((target("avx2")))
+inline void build_avx2(const char *p, size_t n, std::vector<uint32_t> &out) {
+    State st;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64)
+        flatten(structurals_avx2(p + i, st), (uint32_t)i, out);
+    if (i != n) {
+        char tail[64];
+        pad_tail(p + i, n - i, tail);
+        flatten(structurals_avx2(tail, st), (uint32_t)i, out);
+    }
+}
+#endif
+
+inline void build(const char *p, size_t n, std::vector<uint32_t> &out) {
+    out.clear();
+#if defined(__x86_64__)
+    if (simd::has_avx2()) {
+        build_avx2(p, n, out);
+        return;
+    }
+#endif
+    build_generic<Block>(p, n, out);
+}
+
+}
+
+struct JsonDoc {
+    const char *text = nullptr;
+    size_t len = 0;
+    std::vector<uint32_t> pos;      // 结构字符的位置
+
+    char at(size_t i) const {
+        return i < pos.size() ? text[pos[i]] : '\0';
+    }
+
+    const char *ptr(size_t i) const {
+        return i < pos.size() ? text + pos[i] : text + len;
+    }
+};
+
+struct JsonValue {
+    enum Type {
+        Invalid,
+        Null,
+        Bool,
+        Number,
+        String,
+        Array,
+        Object,
+    };
+
+private:
+    const JsonDoc *doc = nullptr;
+    size_t idx = 0;                 // 对象/数组/字符串：开头那个结构字符的下标；标量：后面的分隔符下标
+    const char *begin = nullptr;    // 标量和字符串内容的原始文本
+    const char *end = nullptr;
+    Type ty = Invalid;
+
+    static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    // p 是 : , [ 之后的位置，next 是 p 之后的第一个结构字符下标
+    static JsonValue at_pos(const JsonDoc *doc, const char *p, size_t next) {
+        JsonValue v;
+        const char *limit = doc->ptr(next);
+        while (p < limit && is_space(*p))
+            ++p;
+        v.doc = doc;
+        v.idx = next;
+        if (p == limit) {
+            char c = doc->at(next);
+            if (c == '{' || c == '[') {
+                v.ty = c == '{' ? Object : Array;
+                v.begin = p;
+            } else if (c == '"' && doc->at(next + 1) == '"') {
+                v.ty = String;
+                v.begin = p + 1;
+                v.end = doc->ptr(next + 1);
+            }
+            return v;
+        }
+        const char *e = limit;
+        while (e > p && is_space(e[-1]))
+            --e;
+        v.begin = p;
+        v.end = e;
+        if (*p == 't' || *p == 'f')
+            v.ty = Bool;
+        else if (*p == 'n')
+            v.ty = Null;
+        else
+            v.ty = Number;
+        return v;
+    }
+
+    // 跳过这个值，返回它后面的结构字符下标
+    size_t skip() const {
+        switch (ty) {
+        case Object:
+        case Array: {
+            size_t depth = 0;
+            size_t i = idx;
+            for (; i < doc->pos.size(); ++i) {
+                char c = doc->at(i);
+                if (c == '{' || c == '[') {
+                    ++depth;
+                } else if (c == '}' || c == ']') {
+                    if (--depth == 0)
+                        return i + 1;
+                }
+            }
+            return i;
+        }
+        case String:
+            return idx + 2;
+        default:
+            return idx;
+        }
+    }
+
+    static void put_utf8(std::string &s, uint32_t cp) {
+        if (cp < 0x80) {
+            s.push_back((char)cp);
+        } else if (cp < 0x800) {
+            s.push_back((char)(0xC0 | (cp >> 6)));
+            s.push_back((char)(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            s.push_back((char)(0xE0 | (cp >> 12)));
+            s.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            s.push_back((char)(0x80 | (cp & 0x3F)));
+        } else {
+            s.push_back((char)(0xF0 | (cp >> 18)));
+            s.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+            s.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            s.push_back((char)(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    static bool hex4(const char *p, const char *e, uint32_t &v) {
+        if (e - p < 4)
+            return false;
+        v = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = p[i];
+            v <<= 4;
+            if (c >= '0' && c <= '9') v |= c - '0';
+            else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+            else return false;
+        }
+        return true;
+    }
+
+    // 标量文本拷到栈上补 '\0' 再交给 strtod/strtoll
+    template <class F>
+    auto with_cstr(F f) const -> decltype(f("")) {
+        char tmp[64];
+        size_t n = std::min((size_t)(end - begin), sizeof tmp - 1);
+        memcpy(tmp, begin, n);
+        tmp[n] = '\0';
+        return f(tmp);
+    }
+
+public:
+    JsonValue() = default;
+
+    static JsonValue root(const JsonDoc *doc) {
+        return at_pos(doc, doc->text, 0);
+    }
+
+    Type type() const {
+        return ty;
+    }
+
+    bool exists() const {
+        return ty != Invalid;
+    }
+
+    bool is_null() const {
+        return ty == Null;
+    }
+
+    // 对象里找 key，没有或者不是对象返回 Invalid
+    JsonValue operator[](StrView key) const {
+        if (ty != Object)
+            return JsonValue();
+        size_t j = idx + 1;
+        while (doc->at(j) == '"' && doc->at(j + 1) == '"' && doc->at(j + 2) == ':') {
+            JsonValue k;
+            k.ty = String;
+            k.begin = doc->ptr(j) + 1;
+            k.end = doc->ptr(j + 1);
+            JsonValue v = at_pos(doc, doc->ptr(j + 2) + 1, j + 3);
+            if (k.raw() == key || (k.raw().find('\\') != static_cast<size_t>(-1) && k.as_string() == key.str()))
+                return v;
+            size_t next = v.skip();
+            if (doc->at(next) != ',')
+                break;
+            j = next + 1;
+        }
+        return JsonValue();
+    }
+
+    JsonValue operator[](const char *key) const {
+        return (*this)[StrView(key)];
+    }
+
+    // 数组第 i 个元素
+    JsonValue at(size_t i) const {
+        if (ty != Array)
+            return JsonValue();
+        size_t j = idx + 1;
+        const char *p = doc->ptr(idx) + 1;
+        while (true) {
+            JsonValue v = at_pos(doc, p, j);
+            if (!v.exists())
+                return v;   // 空数组
+            if (i == 0)
+                return v;
+            --i;
+            size_t next = v.skip();
+            if (doc->at(next) != ',')
+                return JsonValue();
+            p = doc->ptr(next) + 1;
+            j = next + 1;
+        }
+    }
+
+    size_t size() const {
+        if (ty != Array)
+            return 0;
+        size_t n = 0;
+        size_t j = idx + 1;
+        const char *p = doc->ptr(idx) + 1;
+        while (true) {
+            JsonValue v = at_pos(doc, p, j);
+            if (!v.exists())
+                return n;
+            ++n;
+            size_t next = v.skip();
+            if (doc->at(next) != ',')
+                return n;
+            p = doc->ptr(next) + 1;
+            j = next + 1;
+        }
+    }
+
+    // 原始文本：字符串是引号里面未解转义的内容，对象和数组只给出开头
+    StrView raw() const {
+        if (ty == Object || ty == Array) {
+            return StrView(begin, doc->ptr(skip() - 1) + 1 - begin);
+        }
+        return StrView(begin, end - begin);
+    }
+
+    std::string as_string() const {
+        if (ty != String)
+            return raw().str();
+        std::string s;
+        s.reserve(end - begin);
+        for (const char *p = begin; p < end; ++p) {
+            if (*p != '\\' || p + 1 == end) {
+                s.push_back(*p);
+                continue;
+            }
+            char c = *++p;
+            switch (c) {
+            case 'b': s.push_back('\b'); break;
+            case 'f': s.push_back('\f'); break;
+            case 'n': s.push_back('\n'); break;
+            case 'r': s.push_back('\r'); break;
+            case 't': s.push_back('\t'); break;
+            case 'u': {
+                uint32_t cp;
+                if (!hex4(p + 1, end, cp)) {
+                    s.push_back(c);
+                    break;
+                }
+                p += 4;
+                uint32_t lo;
+                if (cp >= 0xD800 && cp < 0xDC00 && end - p > 6 && p[1] == '\\' && p[2] == 'u'
+                    && hex4(p + 3, end, lo) && lo >= 0xDC00 && lo < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    p += 6;
+                }
+                put_utf8(s, cp);
+                break;
+            }
+            default:
+                s.push_back(c);     // \" \\ \/
+            }
+        }
+        return s;
+    }
+
+    double as_double() const {
+        if (ty != Number)
+            return 0;
+        return with_cstr([](const char *s) { return strtod(s, nullptr); });
+    }
+
+    int64_t as_int() const {
+        if (ty != Number)
+            return 0;
+        return with_cstr([](const char *s) { return (int64_t)strtoll(s, nullptr, 10); });
+    }
+
+    bool as_bool() const {
+        return ty == Bool && *begin == 't';
+    }
+};
+
+
+struct JsonLinesReader {
+private:
+    std::unique_ptr<BufferedInStream> in;
+    std::string carry;
+    JsonDoc doc;
+    bool indexed = false;
+
+public:
+    explicit JsonLinesReader(std::unique_ptr<BufferedInStream> in_)
+        : in(std::move(in_))
+    {
+    }
+
+    // 读下一条记录，空行跳过，EOF 返回 false
+    bool next() {
+        while (true) {
+            carry.clear();
+            indexed = false;
+            if (!in->fill())
+                return false;
+            char *p = in->buffer();
+            size_t n = in->buffered();
+            char *e = simd::find_byte(p, p + n, '\n');
+            if (e != nullptr) {
+                doc.text = p;
+                doc.len = e - p;
+                in->consume(e + 1 - p);
+            } else {
+                // 跨缓冲区的行拷出来拼接
+                carry.assign(p, n);
+                in->consume(n);
+                while (in->fill()) {
+                    p = in->buffer();
+                    n = in->buffered();
+                    e = simd::find_byte(p, p + n, '\n');
+                    if (e != nullptr) {
+                        carry.append(p, e - p);
+                        in->consume(e + 1 - p);
+                        break;
+                    }
+                    carry.append(p, n);
+                    in->consume(n);
+                }
+                doc.text = carry.data();
+                doc.len = carry.size();
+            }
+            if (doc.len != 0 && doc.text[doc.len - 1] == '\r')
+                --doc.len;
+            for (size_t i = 0; i < doc.len; ++i) {
+                char c = doc.text[i];
+                if (c != ' ' && c != '\t')
+                    return true;
+            }
+        }
+    }
+
+    StrView line() const {
+        return StrView(doc.text, doc.len);
+    }
+
+    JsonValue root() {
+        if (!indexed) {
+            jsonidx::build(doc.text, doc.len, doc.pos);
+            indexed = true;
+        }
+        return JsonValue::root(&doc);
+    }
+
+    JsonValue operator[](StrView key) {
+        return root()[key];
+    }
+
+    JsonValue operator[](const char *key) {
+        return root()[StrView(key)];
+    }
+
+    JsonLinesReader(JsonLinesReader &&) = delete;
+};
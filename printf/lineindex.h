@@ -0,0 +1,359 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "stream.h"
+#include "mmapstream.h"
+#include "byteio.h"
+#include "simd.h"
+
+// 数行和行索引。
+// count_lines 用 simd::count_byte 数换行；mmap 进来的文件切成几段，每个线程数一段。
+// LineIndex 记下每一个换行的偏移，第 N 行（从 0 开始）的开头就是第 N - 1 个换行的下一个字节，
+// 跳到任意一行只要一次 seek。索引可以存成旁边的一个文件（默认是原文件名加 .lidx），
+// 下次打开时文件的大小、修改时间和 inode 都没变就直接读索引，不用再扫一遍。
+//
+// 索引文件，整数都是小端：
+//   "LINEIDX1" [file_size:u64][mtime_ns:u64][inode:u64][N:u64] 然后 N 个 [换行的偏移:u64]
+
+namespace lineindex_detail {
+
+// 把 [p, end) 里所有换行的偏移（加上 base）追加到 out
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+inline void collect_newlines_avx2(const char *p, const char *end, uint64_t base, std::vector<uint64_t> &out) {
+    const char *begin = p;
+    __m256i nl = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), nl));
+        while (m != 0) {
+            out.push_back(base + (p - begin) + __builtin_ctz(m));
+            m &= m - 1;
+        }
+        p += 32;
+    }
+    for (; p != end; ++p)
+        if (*p == '\n')
+            out.push_back(base + (p - begin));
+}
+#endif
+
+inline void collect_newlines(const char *p, const char *end, uint64_t base, std::vector<uint64_t> &out) {
+#if defined(__x86_64__)
+    if (simd::has_avx2()) {
+        collect_newlines_avx2(p, end, base, out);
+        return;
+    }
+#endif
+    const char *begin = p;
+    while ((p = simd::find_byte(p, end, '\n')) != nullptr) {
+        out.push_back(base + (p - begin));
+        ++p;
+    }
+}
+
+// 把 [0, len) 切成 nthreads 段并行地做 f(begin, end, part)，段太小就少开几个线程
+template <class F>
+void parallel_chunks(size_t len, unsigned nthreads, F &&f) {
+    constexpr size_t kMinChunk = 4 << 20;
+    size_t parts = std::max<size_t>(1, std::min<size_t>(nthreads, len / kMinChunk));
+    std::vector<std::thread> ts;
+    for (size_t i = 1; i < parts; i++)
+        ts.emplace_back([&, i] { f(len * i / parts, len * (i + 1) / parts, i); });
+    f(0, len / parts, 0);
+    for (auto &t: ts)
+        t.join();
+}
+
+inline unsigned default_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+} // namespace lineindex_detail
+
+// 数 [p, p + len) 里有几个换行
+inline uint64_t count_lines(const char *p, size_t len, unsigned nthreads = lineindex_detail::default_threads()) {
+    std::vector<uint64_t> counts(nthreads);
+    lineindex_detail::parallel_chunks(len, nthreads, [&](size_t b, size_t e, size_t part) {
+        counts[part] = simd::count_byte(p + b, p + e, '\n');
+    });
+    uint64_t n = 0;
+    for (uint64_t c: counts)
+        n += c;
+    return n;
+}
+
+// 从当前位置读到结尾，数有几个换行。mmap 的流直接并行地数，最后位置停在结尾
+inline uint64_t count_lines(InStream &in) {
+    if (auto *m = dynamic_cast<MmapInStream *>(&in)) {
+        size_t pos = m->tell();
+        uint64_t n = count_lines(m->data() + pos, m->size() - pos);
+        m->seek(0, SEEK_END);
+        return n;
+    }
+    constexpr size_t kChunk = 1 << 20;
+    char *buf = BufferPool::instance().allocate(kChunk);
+    uint64_t n = 0;
+    try {
+        size_t got;
+        while ((got = in.readn(buf, kChunk)) != 0) {
+            n += simd::count_byte(buf, buf + got, '\n');
+            if (got < kChunk)
+                break;
+        }
+    } catch (...) {
+        BufferPool::instance().release(buf, kChunk);
+        throw;
+    }
+    BufferPool::instance().release(buf, kChunk);
+    return n;
+}
+
+struct LineIndex {
+private:
+    // 自己建的索引换行偏移放在 nl 里；从索引文件读的不拷贝，映射着按需读第 i 项
+    std::vector<uint64_t> nl;   // 每个换行的偏移，递增
+    std::shared_ptr<MmapInStream> map;
+    const char *entries = nullptr;
+    uint64_t count = 0;
+    uint64_t file_size = 0;
+
+    // 扫的那个文件的修改时间和 inode，是扫之前在同一个 fd 上 fstat 得到的；不是从文件建的就没有
+    bool has_source = false;
+    uint64_t source_mtime = 0;
+    uint64_t source_ino = 0;
+
+    static constexpr char kMagic[8] = {'L', 'I', 'N', 'E', 'I', 'D', 'X', '1'};
+    static constexpr size_t kHeaderSize = 40;
+
+    static uint64_t mtime_ns(struct stat const &st) {
+        return (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    // 第 i 个换行的偏移
+    uint64_t newline(uint64_t i) const {
+        return entries != nullptr ? load_le64(entries + i * 8) : nl[i];
+    }
+
+public:
+    LineIndex() = default;
+
+    // 并行地扫一块内存
+    static LineIndex build(const char *p, size_t len, unsigned nthreads = lineindex_detail::default_threads()) {
+        LineIndex idx;
+        idx.file_size = len;
+        std::vector<std::vector<uint64_t>> parts(nthreads);
+        lineindex_detail::parallel_chunks(len, nthreads, [&](size_t b, size_t e, size_t part) {
+            parts[part].reserve((e - b) / 64);
+            lineindex_detail::collect_newlines(p + b, p + e, b, parts[part]);
+        });
+        size_t total = 0;
+        for (auto const &v: parts)
+            total += v.size();
+        idx.nl.reserve(total);
+        for (auto const &v: parts)
+            idx.nl.insert(idx.nl.end(), v.begin(), v.end());
+        idx.count = idx.nl.size();
+        return idx;
+    }
+
+    // 从头读到尾扫一遍，流要在开头
+    static LineIndex build(InStream &in) {
+        if (auto *m = dynamic_cast<MmapInStream *>(&in))
+            return build(m->data(), m->size());
+        LineIndex idx;
+        std::vector<char> buf(1 << 20);
+        size_t got;
+        while ((got = in.readn(buf.data(), buf.size())) != 0) {
+            lineindex_detail::collect_newlines(buf.data(), buf.data() + got, idx.file_size, idx.nl);
+            idx.file_size += got;
+            if (got < buf.size())
+                break;
+        }
+        idx.count = idx.nl.size();
+        return idx;
+    }
+
+    // mmap 文件并行地扫。扫之前先在同一个 fd 上 fstat 记下大小、修改时间和 inode，
+    // 之后文件再被改过的话记下的修改时间就对不上了，存下来的索引不会被当成有效的
+    static LineIndex build_file(const char *path) {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        struct stat st;
+        std::unique_ptr<MmapInStream> in;
+        try {
+            if (fstat(fd, &st) < 0) {
+                throw std::system_error(errno, std::generic_category(), path);
+            }
+            in = std::make_unique<MmapInStream>(fd);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        LineIndex idx = build(in->data(), in->size());
+        // fstat 和建映射之间文件长度变了，记下的信息不可信，这个索引就不能存
+        if ((uint64_t)st.st_size == idx.file_size) {
+            idx.has_source = true;
+            idx.source_mtime = mtime_ns(st);
+            idx.source_ino = st.st_ino;
+        }
+        return idx;
+    }
+
+    // 行数；最后一行没有换行也算一行
+    uint64_t lines() const {
+        uint64_t last = count == 0 ? 0 : newline(count - 1) + 1;
+        return count + (last != file_size ? 1 : 0);
+    }
+
+    uint64_t size() const {
+        return file_size;
+    }
+
+    // 第 n 行（从 0 开始）开头的偏移，超过最后一行返回文件大小
+    uint64_t line_start(uint64_t n) const {
+        if (n == 0)
+            return 0;
+        if (n > count)
+            return file_size;
+        return newline(n - 1) + 1;
+    }
+
+    // 第 n 行的长度，不含换行
+    uint64_t line_length(uint64_t n) const {
+        uint64_t b = line_start(n);
+        uint64_t e = n < count ? newline(n) : file_size;
+        return e - b;
+    }
+
+    // 偏移 off 落在第几行
+    uint64_t line_of(uint64_t off) const {
+        uint64_t lo = 0, hi = count;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (newline(mid) < off)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    // 把流定位到第 n 行的开头，流要能 seek
+    off_t seek_to_line(InStream &in, uint64_t n) const {
+        return in.seek((off_t)line_start(n));
+    }
+
+    // 存成 index_path，记下建索引时文件的大小、修改时间和 inode。先写临时文件再改名，不会留下写了一半的索引。
+    // 只有 build_file 建的（或者从索引文件读的）才知道这些，别的抛 EINVAL
+    void save(const char *index_path) const {
+        if (!has_source) {
+            throw std::system_error(EINVAL, std::generic_category(), index_path);
+        }
+        std::string tmp = std::string(index_path) + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), tmp);
+        }
+        try {
+            BufferedOutStream out(std::make_unique<UnixFileOutStream>(fd), BufferedOutStream::FullBuf, nullptr, 1 << 20);
+            char head[kHeaderSize];
+            memcpy(head, kMagic, 8);
+            store_le64(head + 8, file_size);
+            store_le64(head + 16, source_mtime);
+            store_le64(head + 24, source_ino);
+            store_le64(head + 32, count);
+            out.write(head, sizeof(head));
+            if (entries != nullptr) {
+                out.write(entries, count * 8);
+            } else {
+                char b[64 * 1024];
+                size_t n = 0;
+                for (uint64_t off: nl) {
+                    store_le64(b + n, off);
+                    n += 8;
+                    if (n == sizeof(b)) {
+                        out.write(b, n);
+                        n = 0;
+                    }
+                }
+                out.write(b, n);
+            }
+        } catch (...) {
+            unlink(tmp.c_str());
+            throw;
+        }
+        if (rename(tmp.c_str(), index_path) < 0) {
+            int saved = errno;
+            unlink(tmp.c_str());
+            throw std::system_error(saved, std::generic_category(), index_path);
+        }
+    }
+
+    // 读 index_path；索引不存在、坏了或者 path 已经变过了返回 false。
+    // 索引文件只映射不拷贝，查哪一行才读哪一项
+    bool load(const char *path, const char *index_path) {
+        struct stat st;
+        if (stat(path, &st) < 0)
+            return false;
+        int fd = ::open(index_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        std::shared_ptr<MmapInStream> in;
+        try {
+            in = std::make_shared<MmapInStream>(fd);
+        } catch (std::system_error const &) {
+            ::close(fd);
+            return false;
+        }
+        ::close(fd);
+        const char *p = in->data();
+        if (in->size() < kHeaderSize || memcmp(p, kMagic, 8) != 0)
+            return false;
+        uint64_t n = load_le64(p + 32);
+        if (load_le64(p + 8) != (uint64_t)st.st_size || load_le64(p + 16) != mtime_ns(st)
+            || load_le64(p + 24) != (uint64_t)st.st_ino || (in->size() - kHeaderSize) / 8 != n
+            || (in->size() - kHeaderSize) % 8 != 0)
+            return false;
+        madvise((void *)p, in->size(), MADV_RANDOM);
+        nl.clear();
+        map = std::move(in);
+        entries = p + kHeaderSize;
+        count = n;
+        file_size = st.st_size;
+        has_source = true;
+        source_mtime = mtime_ns(st);
+        source_ino = st.st_ino;
+        return true;
+    }
+
+    // 有没过期的索引文件就读它，没有就 mmap 原文件并行地建一个再存下来（存不下来也不要紧）
+    static LineIndex open(const char *path, const char *index_path = nullptr) {
+        std::string def;
+        if (index_path == nullptr) {
+            def = std::string(path) + ".lidx";
+            index_path = def.c_str();
+        }
+        LineIndex idx;
+        if (idx.load(path, index_path))
+            return idx;
+        idx = build_file(path);
+        try {
+            idx.save(index_path);
+        } catch (std::system_error const &) {
+        }
+        return idx;
+    }
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <iterator>
+#include "stream.h"
+#include "strview.h"
+#include "prefetch.h"
+
+// N 路归并已经各自排好序的行流（按字节序比较，和 LC_ALL=C sort 一样）。
+// 每一路当前的行是指向它预读缓冲区的 StrView，跨缓冲区的行才拷进这一路自己的 carry。
+// 用败者树选最小：每出一行只需要沿着那一路的叶子到根比较 log2(N) 次，
+// 不像优先队列那样上下都要比较，也不用为每一行分配一个 std::string。
+// 相等的行先出编号小的那一路，所以归并是稳定的。
+
+struct MergedLineStream : InStream {
+private:
+    struct Source {
+        std::unique_ptr<PrefetchInStream> in;
+        std::string carry;
+        StrView line;
+        size_t pending = 0;     // 当前行（连同换行）在缓冲区里占的字节，下次前进时才 consume
+        bool done = false;
+    };
+
+    std::vector<Source> srcs;
+    std::vector<size_t> tree;   // tree[0] 是胜者，tree[1..k-1] 是各个内部结点上的败者
+    size_t k;
+    bool started = false;
+    bool finished = false;
+    size_t emitted = 0;         // read() 用：当前行已经交出去的字节数，包括最后补的 '\n'
+
+    // 读出第 i 路的下一行，没有了返回 false
+    bool advance(Source &s) {
+        s.in->consume(s.pending);
+        s.pending = 0;
+        s.carry.clear();
+        if (!s.in->fill()) {
+            s.done = true;
+            return false;
+        }
+        char *p = s.in->buffer();
+        size_t n = s.in->buffered();
+        char *e = (char *)memchr(p, '\n', n);
+        if (e != nullptr) {
+            s.line = StrView(p, e - p);
+            s.pending = e + 1 - p;
+            return true;
+        }
+        // 慢路径：这一行跨过了缓冲区边界
+        s.carry.assign(p, n);
+        s.in->consume(n);
+        while (s.in->fill()) {
+            p = s.in->buffer();
+            n = s.in->buffered();
+            e = (char *)memchr(p, '\n', n);
+            if (e != nullptr) {
+                s.carry.append(p, e - p);
+                s.in->consume(e + 1 - p);
+                break;
+            }
+            s.carry.append(p, n);
+            s.in->consume(n);
+        }
+        s.line = StrView(s.carry);
+        return true;
+    }
+
+    // a 是否应该排在 b 前面；读完的一路当作无穷大
+    bool before(size_t a, size_t b) const {
+        if (srcs[a].done)
+            return false;
+        if (srcs[b].done)
+            return true;
+        int c = srcs[a].line.compare(srcs[b].line);
+        return c < 0 || (c == 0 && a < b);
+    }
+
+    // 叶子 i 放在 k + i，内部结点 n 的父结点是 n / 2
+    void build() {
+        std::vector<size_t> win(2 * k);
+        for (size_t i = 0; i < k; i++)
+            win[k + i] = i;
+        for (size_t n = k - 1; n >= 1; n--) {
+            size_t a = win[2 * n], b = win[2 * n + 1];
+            if (before(b, a)) {
+                win[n] = b;
+                tree[n] = a;
+            } else {
+                win[n] = a;
+                tree[n] = b;
+            }
+        }
+        tree[0] = k == 1 ? 0 : win[1];
+    }
+
+    // 第 i 路换了一行，沿着到根的路径和败者们重新比一遍
+    void replay(size_t i) {
+        size_t w = i;
+        for (size_t n = (k + i) / 2; n >= 1; n /= 2) {
+            if (before(tree[n], w))
+                std::swap(tree[n], w);
+        }
+        tree[0] = w;
+    }
+
+public:
+    // size 是每一路每个预读缓冲区的大小，总共占 2 * N * size
+    explicit MergedLineStream(std::vector<std::unique_ptr<InStream>> inputs, size_t size = 64 * 1024)
+        : srcs(inputs.size())
+        , tree(std::max<size_t>(inputs.size(), 1))
+        , k(inputs.size())
+    {
+        for (size_t i = 0; i < k; i++)
+            srcs[i].in = std::make_unique<PrefetchInStream>(std::move(inputs[i]), size);
+    }
+
+    // 前进到下一行，全部读完返回 false
+    bool next() {
+        if (k == 0 || finished)
+            return false;
+        emitted = 0;
+        if (!started) {
+            started = true;
+            for (auto &s: srcs)
+                advance(s);
+            build();
+        } else {
+            size_t w = tree[0];
+            advance(srcs[w]);
+            replay(w);
+        }
+        finished = srcs[tree[0]].done;
+        return !finished;
+    }
+
+    // 当前行，不含换行，下一次 next() 之前有效
+    StrView line() const {
+        return srcs[tree[0]].line;
+    }
+
+    // 当前行来自第几路
+    size_t source() const {
+        return tree[0];
+    }
+
+    // 当成普通的 InStream 读：每行后面补一个 '\n'
+    size_t read(char *__restrict s, size_t len) override {
+        size_t n = 0;
+        while (n != len && !finished) {
+            if (!started || emitted == line().size() + 1) {
+                if (!next())
+                    break;
+            }
+            StrView l = line();
+            if (emitted < l.size()) {
+                size_t m = std::min(len - n, l.size() - emitted);
+                memcpy(s + n, l.data() + emitted, m);
+                emitted += m;
+                n += m;
+            } else {
+                s[n++] = '\n';
+                ++emitted;
+            }
+        }
+        return n;
+    }
+
+    struct iterator {
+        using iterator_category = std::input_iterator_tag;
+        using value_type = StrView;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const StrView *;
+        using reference = StrView;
+
+        MergedLineStream *m;
+
+        StrView operator*() const {
+            return m->line();
+        }
+
+        iterator &operator++() {
+            if (!m->next())
+                m = nullptr;
+            return *this;
+        }
+
+        bool operator==(iterator const &o) const {
+            return m == o.m;
+        }
+
+        bool operator!=(iterator const &o) const {
+            return m != o.m;
+        }
+    };
+
+    // for (StrView line: merged) { ... }
+    iterator begin() {
+        return {next() ? this : nullptr};
+    }
+
+    iterator end() {
+        return {nullptr};
+    }
+
+    MergedLineStream(MergedLineStream &&) = delete;
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <memory>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stream.h"
+#include "hugepage.h"
+
+// 把整个文件映射进来读，read 只是一次 memcpy，data() 可以直接零拷贝地访问。
+// 大于 2MiB 的文件按 2MiB 对齐映射并请求透明大页（文件系统支持只读大页时才会生效），
+// 顺序扫描时 TLB 缺失和缺页都少很多。映射建好之后文件变短的话访问会 SIGBUS，和所有 mmap 一样。
+
+struct MmapInStream : InStream {
+private:
+    char *base = nullptr;
+    size_t len = 0;
+    size_t pos = 0;
+    PageBacking backing = PageBacking::Normal;
+
+    // 先占一段 2MiB 对齐的地址，再把文件 MAP_FIXED 映射上去
+    void map_aligned(int fd) {
+        size_t mapped = (len + BufferPool::kPageSize - 1) & ~(BufferPool::kPageSize - 1);
+        size_t span = mapped + kHugePageSize;
+        void *p = mmap(nullptr, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        uintptr_t start = (uintptr_t)p;
+        uintptr_t aligned = (start + kHugePageSize - 1) & ~(uintptr_t)(kHugePageSize - 1);
+        if (mmap((void *)aligned, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            int saved = errno;
+            munmap(p, span);
+            throw std::system_error(saved, std::generic_category());
+        }
+        if (aligned != start)
+            munmap(p, aligned - start);
+        if (aligned + mapped != start + span)
+            munmap((void *)(aligned + mapped), start + span - (aligned + mapped));
+        base = (char *)aligned;
+        backing = advise_huge(base, mapped);
+    }
+
+public:
+    // 不接管 fd，映射建好后关掉 fd 也不影响
+    explicit MmapInStream(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        len = st.st_size;
+        if (len == 0)
+            return;
+        if (len >= kHugePageSize) {
+            map_aligned(fd);
+        } else {
+            void *p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category());
+            }
+            base = (char *)p;
+        }
+        madvise(base, len, MADV_SEQUENTIAL);
+    }
+
+    const char *data() const {
+        return base;
+    }
+
+    size_t size() const {
+        return len;
+    }
+
+    PageBacking page_backing() const {
+        return backing;
+    }
+
+    int getchar() override {
+        if (pos == len)
+            return EOF;
+        return (unsigned char)base[pos++];
+    }
+
+    size_t read(char *__restrict s, size_t n) override {
+        n = std::min(n, len - pos);
+        if (n == 0)
+            return 0;
+        memcpy(s, base + pos, n);
+        pos += n;
+        return n;
+    }
+
+    size_t readn(char *__restrict s, size_t n) override {
+        return read(s, n);
+    }
+
+    off_t seek(off_t offset, int whence = SEEK_SET) override {
+        off_t target = offset;
+        if (whence == SEEK_CUR)
+            target += (off_t)pos;
+        else if (whence == SEEK_END)
+            target += (off_t)len;
+        if (target < 0) {
+            throw std::system_error(EINVAL, std::generic_category());
+        }
+        pos = std::min((size_t)target, len);
+        return pos;
+    }
+
+    MmapInStream(MmapInStream &&) = delete;
+
+    ~MmapInStream() {
+        if (base != nullptr)
+            munmap(base, len);
+    }
+};
+
+inline std::unique_ptr<MmapInStream> in_file_open_mmap(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    std::unique_ptr<MmapInStream> p;
+    try {
+        p = std::make_unique<MmapInStream>(fd);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    return p;
+}
@@ -1,392 +1,323 @@
 #include <cstdio>
-#include <unistd.h>
-#include <thread>
-#include <string>
-#include <fcntl.h>
-#include <system_error>
-#include <map>
+#include <cerrno>
+#include <cstring>
+#include "stream.h"
+#include "compress.h"
+#include "parallel_compress.h"
+#include "checksum.h"
+#include "record.h"
+#include "csv.h"
+#include "jsonl.h"
+#include "async.h"
+#include "socket.h"
+#include "subprocess.h"
+#include "mmapstream.h"
+#include "readmany.h"
+#include "merge.h"
+#include "binlog.h"
+#include "pipeline.h"
+#include "lineindex.h"
+#include "follow.h"
+#include "utf8.h"
 
 using namespace std;
 
-struct InStream {
-    virtual size_t read(char *__restrict s, size_t len) = 0;
-    virtual ~InStream() = default;
-
-    virtual int getchar() {
-        char c;
-        size_t n = read(&c, 1);
-        if (n == 0) {
-            return EOF;
-        }
-        return c;
-    }
+// 演示用：每次系统调用前睡 0.1 秒，模拟很慢的设备，看得出缓冲省了多少次调用
+struct SlowInStream : InStream {
+private:
+    std::unique_ptr<InStream> in;
 
-    virtual size_t readn(char *__restrict s, size_t len) {
-        size_t n = read(s, len);
-        if (n == 0) return 0;
-        while (n != len) {
-            size_t m = read(s + n, len - n);
-            if (m == 0) break;
-            n += m;
-        }
-        return n;
+public:
+    explicit SlowInStream(std::unique_ptr<InStream> in_) : in(std::move(in_)) {
     }
 
-    std::string readall() {
-        std::string ret;
-        ret.resize(32);
-        char *buf = &ret[0];
-        size_t pos = 0;
-        while (true) {
-            size_t n = read(buf + pos, ret.size() - pos);
-            if (n == 0) {
-                break;
-            }
-            pos += n;
-            if (pos == ret.size()) {
-                ret.resize(ret.size() * 2);
-            }
-        }
-        ret.resize(pos);
-        return ret;
+    size_t read(char *__restrict s, size_t len) override {
+        if (len == 0)   return 0;
+        this_thread::sleep_for(0.1s);
+        return in->read(s, len);
     }
+};
 
-    std::string readuntil(char eol) {
-        std::string ret;
-        while (true) {
-            int c = getchar();
-            if (c == EOF) {
-                break;
-            }
-            ret.push_back(c);
-            if (c == eol) {
-                break;
-            }
-        }
-        return ret;
-    }
+struct SlowOutStream : OutStream {
+private:
+    std::unique_ptr<OutStream> out;
 
-    std::string readuntil(const char *__restrict eol, size_t neol) {
-        std::string ret;
-        while (true) {
-            int c = getchar();
-            if (c == EOF) {
-                break;
-            }
-            ret.push_back(c);
-            if (ret.size() >= neol) {
-                if (memcmp(ret.data() + ret.size() - neol, eol, neol) == 0) {
-                    break;
-                }
-            }
-        }
-        return ret;
+public:
+    explicit SlowOutStream(std::unique_ptr<OutStream> out_) : out(std::move(out_)) {
     }
 
-    std::string readuntil(std::string const &eol) {
-        return readuntil(eol.data(), eol.size());
+    void write(const char *__restrict s, size_t len) override {
+        if (len == 0)   return;
+        this_thread::sleep_for(0.1s);
+        out->write(s, len);
     }
 
-
-    std::string getline(char eol) {
-        std::string ret = readuntil(eol);
-        if (ret.size() > 0 && ret.back() == eol)
-            ret.pop_back();
-        return ret;
+    void writev(const struct iovec *iov, int iovcnt) override {
+        this_thread::sleep_for(0.1s);
+        out->writev(iov, iovcnt);
     }
 
-    std::string getline(const char *__restrict eol, size_t neol) {
-        std::string ret = readuntil(eol, neol);
-        if (ret.size() >= neol && memcmp(ret.data() + ret.size() - neol, eol, neol) == 0)
-            ret.resize(ret.size() - neol);
-        return ret;
+    bool is_terminal() override {
+        return out->is_terminal();
     }
 
-    std::string getline(std::string const &eol) {
-        return getline(eol.data(), eol.size());
+    void flush() override {
+        out->flush();
     }
 };
 
+BufferedInStream myin(std::make_unique<SlowInStream>(std::make_unique<UnixFileInStream>(STDIN_FILENO)));
+BufferedOutStream mout(std::make_unique<SlowOutStream>(std::make_unique<UnixFileOutStream>(STDOUT_FILENO)), BufferedOutStream::Adaptive);
+BasicBufferedOutStream<NoBuffering> merr(std::make_unique<SlowOutStream>(std::make_unique<UnixFileOutStream>(STDERR_FILENO)));
 
-struct UnixFileInStream : InStream {
-private:
-    int fd;
+void mperror(const char *msg) {
+    merr.message() << msg << ": " << strerror(errno) << '\n';
+}
 
-public:
-    explicit UnixFileInStream(int fd_) : fd(fd_) {
 
+int main() {
+    {
+        auto p = out_file_open("/tmp/a.txt", OpenFlag::Write);
+        p->puts("Hello!\nWorld!\n");
     }
-
-    size_t read(char *__restrict s, size_t len) override {
-        if (len == 0)   return 0;
-        this_thread::sleep_for(0.1s);
-        size_t n = ::read(fd, s, len);
-        if (n < 0) {
-            throw std::system_error(errno, std::generic_category());
+    {
+        auto p = in_file_open("/tmp/a.txt", OpenFlag::Read);
+        auto s = p->getline('\n');
+        printf("%s\n", s.c_str());
+        s = p->getline('\n');
+        printf("%s\n", s.c_str());
+        s = p->getline('\n');
+        printf("%s\n", s.c_str());
+    }
+    {
+        auto p = out_file_open_compressed("/tmp/a.lz", OpenFlag::Write);
+        for (int i = 0; i < 1000; i++) {
+            p->puts("Hello, compressed world!\n");
         }
-        return n;
     }
-
-    UnixFileInStream(UnixFileInStream &&) = delete;
-
-    ~UnixFileInStream() {
-        ::close(fd);
+    {
+        auto p = in_file_open_compressed("/tmp/a.lz", OpenFlag::Read);
+        auto s = p->readall();
+        printf("%zu bytes, %s\n", s.size(), p->getline('\n').empty() ? "eof" : "?");
+        printf("%s", s.substr(0, s.find('\n') + 1).c_str());
     }
-};
-
-
-struct BufferedInStream : InStream {
-private:
-    std::unique_ptr<InStream> in;
-    char *buf;
-    size_t top = 0;
-    size_t max = 0;
-
-    [[nodiscard]] bool refill() {
-        top = 0;
-        max = in->read(buf, BUFSIZ);
-        // max <= BUFSIZ
-        return max != 0;
+    {
+        auto p = out_file_open_parallel_compressed("/tmp/b.lz", Codec::Lz, 4);
+        for (int i = 0; i < 100000; i++) {
+            p->puts("line ");
+            p->puts(std::to_string(i).c_str());
+            p->putchar('\n');
+        }
     }
-
-public:
-    explicit BufferedInStream(std::unique_ptr<InStream> in_)
-        : in(std::move(in_))
     {
-        buf = (char *)valloc(BUFSIZ);
+        auto p = in_file_open_compressed_at("/tmp/b.lz", 500000);
+        printf("%s\n", p->getline('\n').c_str());
     }
-
-    int getchar() override {
-        if (top == max) {
-            if (!refill())
-                return EOF;
-        }
-        return buf[top++];
+    {
+        auto p = std::make_unique<ChecksummingOutStream>(out_file_open("/tmp/c.txt", OpenFlag::Write));
+        p->puts("Hello!\nWorld!\n");
+        printf("crc32c: %08llx\n", (unsigned long long)p->digest());
     }
-
-    size_t read(char *__restrict s, size_t len) override {
-        // 如果缓冲区为空，则阻塞，否则尽量不阻塞，返回已缓冲的字符
-        char *__restrict p = s;
-        while (p != s + len) {
-            if (top == max) {
-                if (p != s || !refill())
-                    break;
-            }
-            int c = buf[top++];
-            *p++ = c;
-        }
-        return p - s;
+    {
+        VerifyingInStream p(std::make_unique<BufferedInStream>(in_file_open("/tmp/c.txt", OpenFlag::Read)));
+        auto s = p.readall();
+        printf("%zu bytes, verified: %d\n", s.size(), p.is_verified());
     }
-
-    size_t readn(char *__restrict s, size_t len) override {
-        // 尽量读满 len 个字符，除非遇到 EOF，才会返回小于 len 的值
-        char *__restrict p = s;
-        while (p != s + len) {
-            if (top == max) {
-                if (!refill())
-                    break;
-            }
-            int c = buf[top++];
-            *p++ = c;
+    {
+        RecordWriter w(out_file_open("/tmp/d.rec", OpenFlag::Write));
+        for (int i = 0; i < 1000; i++) {
+            w.write(std::string("record\0#", 8) + std::to_string(i));
         }
-        return p - s;
     }
-
-    BufferedInStream(BufferedInStream &&) = delete;
-
-    ~BufferedInStream() {
-        free(buf);
+    {
+        RecordReader r(std::make_unique<BufferedInStream>(in_file_open("/tmp/d.rec", OpenFlag::Read)));
+        std::string rec;
+        r.seek_record(777);
+        r.next(rec);
+        printf("%llu records, #777 = %s\n", (unsigned long long)r.record_count(), rec.c_str() + 8);
     }
-};
-
-
-struct OutStream {
-    virtual void write(const char *__restrict s, size_t len) = 0;
-
-    virtual ~OutStream() = default;
-
-    void puts(const char *__restrict s) {
-        write(s, strlen(s));
+    {
+        auto p = out_file_open("/tmp/e.csv", OpenFlag::Write);
+        p->puts("name,comment\nalice,\"says \"\"hi\"\", twice\"\r\nbob,\n");
     }
-
-    virtual void putchar(char c) {
-        write(&c, 1);
+    {
+        CsvReader r(std::make_unique<BufferedInStream>(in_file_open("/tmp/e.csv", OpenFlag::Read)));
+        while (r.next_row()) {
+            printf("%zu fields: [%s] [%s]\n", r.size(), r[0].str().c_str(), r[1].str().c_str());
+        }
     }
-
-    virtual void flush() {
-
+    {
+        auto p = out_file_open("/tmp/f.jsonl", OpenFlag::Write);
+        p->puts("{\"id\": 1, \"user\": {\"name\": \"alice\"}, \"tags\": [\"a\", \"b\"]}\n");
+        p->puts("{\"id\": 2, \"user\": {\"name\": \"bob\\u00e9\"}, \"tags\": []}\n");
     }
-};
-
-struct UnixFileOutStream : OutStream {
-private:
-    int fd;
-
-public:
-    explicit UnixFileOutStream(int fd_) : fd(fd_) {
-
+    {
+        JsonLinesReader r(std::make_unique<BufferedInStream>(in_file_open("/tmp/f.jsonl", OpenFlag::Read)));
+        while (r.next()) {
+            printf("%lld %s %zu\n", (long long)r["id"].as_int(), r["user"]["name"].as_string().c_str(), r["tags"].size());
+        }
     }
-
-    void write(const char *__restrict s, size_t len) override {
-        if (len == 0)   return;
-        this_thread::sleep_for(0.1s);
-        size_t written = ::write(fd, s, len);
-        if (written < 0) {
+    {
+        EventLoop loop;
+        int fds[2];
+        if (pipe(fds) < 0) {
             throw std::system_error(errno, std::generic_category());
         }
-
-        if (written == 0) {
-            throw std::system_error(EPIPE, std::generic_category());
-        }
-
-        while ((size_t)written != len) {
-            size_t new_written = ::write(fd, s + written, len - written);
-            if (new_written < 0) {
-                throw std::system_error(errno, std::generic_category());
+        AsyncInStream in(loop, fds[0]);
+        auto out = std::make_unique<AsyncOutStream>(loop, fds[1]);
+        loop.spawn([](std::unique_ptr<AsyncOutStream> out) -> Task<void> {
+            for (int i = 0; i < 3; i++) {
+                co_await out->async_write("async line " + std::to_string(i) + "\n");
+            }
+        }(std::move(out)));
+        loop.spawn([](AsyncInStream &in) -> Task<void> {
+            while (true) {
+                auto s = co_await in.async_getline();
+                if (s.empty())
+                    break;
+                printf("%s\n", s.c_str());
+            }
+        }(in));
+        loop.run();
+    }
+    {
+        int lfd = tcp_listen("127.0.0.1", 0);
+        std::thread server([lfd] {
+            auto s = socket_streams(socket_accept(lfd));
+            while (true) {
+                auto line = s.in->getline('\n');
+                if (line.empty())
+                    break;
+                s.out->puts(("echo: " + line + "\n").c_str());
             }
-            written += new_written;
+            s.shutdown();
+        });
+        auto c = socket_streams(tcp_connect("127.0.0.1", socket_local_port(lfd)));
+        c.out->puts("Hello!\nWorld!\n");
+        c.shutdown();
+        while (true) {
+            auto line = c.in->getline('\n');
+            if (line.empty())
+                break;
+            printf("%s\n", line.c_str());
         }
+        server.join();
+        close(lfd);
     }
-
-    UnixFileOutStream(UnixFileOutStream &&) = delete;
-
-    ~UnixFileOutStream() {
-        ::close(fd);
+    {
+        auto p = popen_streams({"tr", "a-z", "A-Z"}, 1 << 20);
+        p.in->puts("Hello, subprocess!\n");
+        p.close_stdin();
+        printf("%s\n", p.out->getline('\n').c_str());
+        printf("exit: %d\n", p.wait());
     }
-};
-
-struct BufferedOutStream : OutStream{
-    enum BufferMode {
-        FullBuf,
-        LineBuf,
-        NoBuf,
-    };
-
-private:
-    std::unique_ptr<OutStream> out;
-    size_t top = 0;
-    BufferMode mode;
-    char *buf;
-
-public:
-    explicit BufferedOutStream(std::unique_ptr<OutStream> out_, BufferMode mode_ = FullBuf, char *buf_ = nullptr) 
-            : out(std::move(out_))
-            , mode(mode_)
-            , buf(buf_) 
     {
-        if (buf == nullptr && mode != _IONBF) {
-            buf = (char *)valloc(4096);
+        BufferedOutStream p(std::make_unique<UnixFileOutStream>(open("/tmp/g.txt", O_WRONLY | O_TRUNC | O_CREAT, 0644)),
+                            BufferedOutStream::FullBuf, nullptr, 4 << 20);
+        for (int i = 0; i < 500000; i++) {
+            p.puts("line ");
+            p.puts(std::to_string(i).c_str());
+            p.putchar('\n');
         }
+        printf("buffer: %s\n", page_backing_name(p.page_backing()));
     }
-
-    void flush() override {
-        out->write(buf, top);
-        top = 0;
+    {
+        auto p = in_file_open_mmap("/tmp/g.txt");
+        p->seek(-12, SEEK_END);
+        printf("%zu bytes, mmap: %s, last: %s", p->size(), page_backing_name(p->page_backing()), p->readall().c_str());
     }
-
-    void putchar(char c) override {
-        if (mode == _IONBF) {
-            out->write(&c, 1);
-            return;
-        }
-        if (top == BUFSIZ) {
-            flush();
-        }
-        buf[top++] = c;
-        if (mode == _IOLBF && c == '\n') {
-            flush();
+    {
+        const char *paths[] = {"/tmp/a.txt", "/tmp/c.txt", "/tmp/g.txt"};
+        std::vector<std::unique_ptr<InStream>> ins;
+        std::vector<ReadRequest> reqs;
+        char bufs[3][6];
+        for (int i = 0; i < 3; i++) {
+            ins.push_back(in_file_open(paths[i], OpenFlag::Read));
+            reqs.push_back({ins.back().get(), bufs[i], sizeof(bufs[i])});
         }
+        read_many(reqs, [](ReadRequest &r) {
+            printf("read_many: %.*s\n", (int)r.n, r.buf);
+        });
     }
-
-    void write(const char *__restrict s, size_t len) override {
-        if (mode == _IONBF) {
-            out->write(s, len);
-            return;
+    {
+        out_file_open("/tmp/h1.txt", OpenFlag::Write)->puts("apple\ncherry\nfig\n");
+        out_file_open("/tmp/h2.txt", OpenFlag::Write)->puts("banana\ncherry\ndate\n");
+        std::vector<std::unique_ptr<InStream>> ins;
+        ins.push_back(in_file_open("/tmp/h1.txt", OpenFlag::Read));
+        ins.push_back(in_file_open("/tmp/h2.txt", OpenFlag::Read));
+        MergedLineStream m(std::move(ins));
+        for (StrView line: m) {
+            printf("merged: %s (from %zu)\n", line.str().c_str(), m.source());
         }
-        for (const char *__restrict p = s; p != s + len; ++p) {
-            if (top == BUFSIZ) {
-                flush();
-            }
-            char c = *p;
-            buf[top++] = c;
-            if (mode == _IOLBF && c == '\n') {
-                flush();
-            }
+    }
+    {
+        auto log = out_file_open("/tmp/i.log", OpenFlag::Write);
+        auto &blog = static_cast<BufferedOutStream &>(*log);
+        blog.flush_within(std::chrono::milliseconds(100));
+        blog.puts("log line 1\n");
+        blog.puts("log line 2\n");
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        printf("on disk before close: %zu bytes\n", in_file_open("/tmp/i.log", OpenFlag::Read)->readall().size());
+    }
+    {
+        BinLogger::instance().start(out_file_open("/tmp/j.log", OpenFlag::Write));
+        std::vector<std::thread> ts;
+        for (int t = 0; t < 4; t++) {
+            ts.emplace_back([t] {
+                for (int i = 0; i < 1000; i++)
+                    BINLOG("worker %d: step %d of %s, %.2f%%", t, i, "binlog", i / 10.0);
+            });
         }
+        for (auto &t: ts)
+            t.join();
+        BinLogger::instance().flush();
+        printf("binlog: %s\n", in_file_open("/tmp/j.log", OpenFlag::Read)->getline('\n').c_str());
     }
-
-    BufferedOutStream(BufferedOutStream &&) = delete;   // 有析构需要去除移动函数，删除这一个即可删除其他三个
-
-    ~BufferedOutStream() {
-        flush();
-        free(buf);
+    {
+        BufferedInStream in(in_file_open("/tmp/g.txt", OpenFlag::Read), 1 << 20);
+        auto out = out_file_open("/tmp/l.txt", OpenFlag::Write);
+        uint64_t n = lines(in).parallel(4)
+                .filter([](StrView line) { return line.size() != 0 && line[line.size() - 1] == '7'; })
+                .map([](StrView line, std::string &res) {
+                    res = "LINE";
+                    res.append(line.data() + 4, line.size() - 4);
+                })
+                .write_to(*out);
+        printf("pipeline: %llu lines\n", (unsigned long long)n);
     }
-};
-
-BufferedInStream myin(std::make_unique<UnixFileInStream>(STDIN_FILENO));
-BufferedOutStream mout(std::make_unique<UnixFileOutStream>(STDOUT_FILENO), BufferedOutStream::LineBuf);
-BufferedOutStream merr(std::make_unique<UnixFileOutStream>(STDERR_FILENO), BufferedOutStream::NoBuf);
-
-void mperror(const char *msg) {
-    merr.puts(msg);
-    merr.puts(": ");
-    merr.puts(strerror(errno));
-    merr.puts("\n");
-}
-
-enum OpenFlag {
-    Read,
-    Write,
-    Append,
-    ReadWrite,
-};
-
-std::map<OpenFlag, int> openFlagToUnixFlag = {
-    {OpenFlag::Read, O_RDONLY},
-    {OpenFlag::Write, O_WRONLY | O_TRUNC | O_CREAT},
-    {OpenFlag::Append, O_WRONLY | O_APPEND | O_CREAT},
-    {OpenFlag::ReadWrite, O_RDWR | O_CREAT},
-};
-
-std::unique_ptr<OutStream> out_file_open(const char *path, OpenFlag flag) {
-    int oflag = openFlagToUnixFlag.at(flag);
-    // oflag |= O_DIRECT;
-    int fd = open(path, oflag);
-    if (fd < 0) {
-        throw std::system_error(errno, std::generic_category());
-        // mperror(path);
-        return nullptr;
-    }
-    auto file = std::make_unique<UnixFileOutStream>(fd);
-    return std::make_unique<BufferedOutStream>(std::move(file));
-}
-
-std::unique_ptr<InStream> in_file_open(const char *path, OpenFlag flag) {
-    int oflag = openFlagToUnixFlag.at(flag);
-    // oflag |= O_DIRECT;
-    int fd = open(path, oflag);
-    if (fd < 0) {
-        throw std::system_error(errno, std::generic_category());
-        // mperror(path);
-        return nullptr;
-    }
-    auto file = std::make_unique<UnixFileInStream>(fd);
-    return file;
-}
-
-
-int main() {
     {
-        auto p = out_file_open("/tmp/a.txt", OpenFlag::Write);
-        p->puts("Hello!\nWorld!\n");
+        printf("count_lines: %llu\n", (unsigned long long)count_lines(*in_file_open_mmap("/tmp/g.txt")));
+        LineIndex idx = LineIndex::open("/tmp/g.txt");
+        auto in = in_file_open("/tmp/g.txt", OpenFlag::Read);
+        idx.seek_to_line(*in, 400000);
+        printf("line 400000 of %llu: %s\n", (unsigned long long)idx.lines(), in->getline('\n').c_str());
     }
     {
-        auto p = in_file_open("/tmp/a.txt", OpenFlag::Read);
-        auto s = p->getline('\n');
-        printf("%s\n", s.c_str());
-        s = p->getline('\n');
-        printf("%s\n", s.c_str());
-        s = p->getline('\n');
-        printf("%s\n", s.c_str());
+        out_file_open("/tmp/m.log", OpenFlag::Write)->puts("first\n");
+        FollowingInStream in("/tmp/m.log", false, 500);
+        std::thread writer([] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            out_file_open("/tmp/m.log", OpenFlag::Append)->puts("appended\n");
+        });
+        printf("follow: %s", in.getline('\n').c_str());
+        printf(", %s\n", in.getline('\n').c_str());
+        writer.join();
     }
-}
\ No newline at end of file
+    {
+        {
+            Utf8ToUtf16OutStream out(out_file_open("/tmp/u16.txt", OpenFlag::Write), Utf16Order::Little, true);
+            out.puts("你好, UTF-16!\n");
+        }
+        Utf8ValidatingInStream in(std::make_unique<Utf16ToUtf8InStream>(in_file_open("/tmp/u16.txt", OpenFlag::Read)));
+        printf("utf16: %s\n", in.getline('\n').c_str());
+    }
+    {
+        out_file_open("/tmp/u8.txt", OpenFlag::Write)->puts("ok\n\xe4\xbd\xa0\xff\n");
+        Utf8ValidatingInStream in(in_file_open("/tmp/u8.txt", OpenFlag::Read));
+        try {
+            in.readall();
+        } catch (std::system_error const &e) {
+            printf("utf8: %s\n", e.what());
+        }
+    }
+}
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <algorithm>
+#include <sys/stat.h>
+#include "compress.h"
+
+// 块格式和 compress.h 相同，DecompressingInStream 可以直接读。
+// 结束块后面追加块索引：N 个 [file_offset:u64][raw_offset:u64]，再跟 [N:u64]["BLKIDX01"]
+// file_offset 从流的开头算起，所以要求流从文件开头写（Write 而不是 Append）。
+
+struct BlockIndexEntry {
+    uint64_t file_offset;
+    uint64_t raw_offset;
+};
+
+constexpr char kBlockIndexMagic[8] = {'B', 'L', 'K', 'I', 'D', 'X', '0', '1'};
+constexpr size_t kBlockIndexTrailerSize = 16;
+
+struct ParallelCompressingOutStream : OutStream {
+private:
+    struct Job {
+        uint64_t seq;
+        std::vector<char> raw;
+        std::vector<char> block;
+    };
+
+    std::unique_ptr<OutStream> out;
+    Codec codec;
+    int level;
+    size_t block_size;
+    size_t max_inflight;
+    std::vector<char> raw;
+    uint64_t next_seq = 0;
+    bool finished = false;
+
+    std::mutex mtx;
+    std::condition_variable cv_job;
+    std::condition_variable cv_done;
+    std::condition_variable cv_space;
+    std::deque<std::unique_ptr<Job>> pending;
+    std::map<uint64_t, std::unique_ptr<Job>> done;     // 乱序完成的块在这里排队
+    std::vector<std::unique_ptr<Job>> free_jobs;        // 用完的块缓冲复用，不反复分配
+    size_t inflight = 0;
+    bool stopping = false;
+    std::exception_ptr error;           // 第一个错误，一直留着：之后的 write / flush / finish 都抛出它
+    std::atomic<bool> failed{false};    // write / putchar 不加锁先看一眼
+
+    // 只有写线程访问
+    uint64_t written_seq = 0;
+    uint64_t raw_offset = 0;
+    uint64_t file_offset = 0;
+    std::vector<BlockIndexEntry> index;
+
+    std::vector<std::thread> workers;
+    std::thread writer;
+
+    void worker_main() {
+        BlockCompressor comp(codec, level);
+        std::unique_lock<std::mutex> lck(mtx);
+        while (true) {
+            cv_job.wait(lck, [&] { return stopping || !pending.empty(); });
+            if (pending.empty())
+                return;
+            auto job = std::move(pending.front());
+            pending.pop_front();
+            lck.unlock();
+            job->block.clear();
+            try {
+                comp.encode_block(job->raw.data(), job->raw.size(), job->block);
+                lck.lock();
+            } catch (...) {
+                lck.lock();
+                set_error(std::current_exception());
+            }
+            done.emplace(job->seq, std::move(job));
+            cv_done.notify_all();
+        }
+    }
+
+    void writer_main() {
+        std::unique_lock<std::mutex> lck(mtx);
+        while (true) {
+            cv_done.wait(lck, [&] {
+                return (stopping && inflight == 0) || (!done.empty() && done.begin()->first == written_seq);
+            });
+            if (done.empty() || done.begin()->first != written_seq)
+                return;
+            auto job = std::move(done.begin()->second);
+            done.erase(done.begin());
+            bool skip = (bool)error;   // 前面已经出错了，后面的块不再写
+            lck.unlock();
+            if (!skip) {
+                try {
+                    out->write(job->block.data(), job->block.size());
+                    index.push_back({file_offset, raw_offset});
+                    file_offset += job->block.size();
+                    raw_offset += job->raw.size();
+                } catch (...) {
+                    lck.lock();
+                    set_error(std::current_exception());
+                    lck.unlock();
+                }
+            }
+            lck.lock();
+            ++written_seq;
+            --inflight;
+            job->raw.clear();
+            free_jobs.push_back(std::move(job));
+            cv_space.notify_all();
+        }
+    }
+
+    // 调用时持有 mtx
+    void set_error(std::exception_ptr e) {
+        if (!error) {
+            error = e;
+            failed.store(true, std::memory_order_release);
+        }
+    }
+
+    // 调用时持有 mtx
+    void rethrow_error() {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    void check_failed() {
+        if (failed.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lck(mtx);
+            rethrow_error();
+        }
+    }
+
+    void submit() {
+        if (raw.empty())
+            return;
+        std::unique_lock<std::mutex> lck(mtx);
+        cv_space.wait(lck, [&] { return inflight < max_inflight; });
+        rethrow_error();
+        std::unique_ptr<Job> job;
+        if (!free_jobs.empty()) {
+            job = std::move(free_jobs.back());
+            free_jobs.pop_back();
+        } else {
+            job = std::make_unique<Job>();
+            job->raw.reserve(block_size);
+        }
+        job->seq = next_seq++;
+        job->raw.swap(raw);
+        ++inflight;
+        pending.push_back(std::move(job));
+        cv_job.notify_one();
+        if (raw.capacity() < block_size)
+            raw.reserve(block_size);
+    }
+
+    // 等所有块写完，此后写线程空闲，可以在当前线程直接操作 out
+    void drain() {
+        submit();
+        std::unique_lock<std::mutex> lck(mtx);
+        cv_space.wait(lck, [&] { return inflight == 0; });
+        rethrow_error();
+    }
+
+    void stop_threads() {
+        {
+            std::lock_guard<std::mutex> lck(mtx);
+            stopping = true;
+        }
+        cv_job.notify_all();
+        cv_done.notify_all();
+        for (auto &t: workers)
+            t.join();
+        writer.join();
+        workers.clear();
+    }
+
+public:
+    explicit ParallelCompressingOutStream(std::unique_ptr<OutStream> out_, Codec codec_ = Codec::Lz,
+                                          size_t nthreads = std::thread::hardware_concurrency(),
+                                          size_t block_size_ = kDefaultBlockSize, int level_ = 0)
+        : out(std::move(out_))
+        , codec(codec_)
+        , level(level_)
+        , block_size(block_size_)
+    {
+        if (!codec_available(codec)) {
+            throw std::system_error(ENOTSUP, std::generic_category());
+        }
+        if (nthreads == 0)
+            nthreads = 1;
+        max_inflight = nthreads * 2;
+        raw.reserve(block_size);
+        for (size_t i = 0; i < nthreads; ++i)
+            workers.emplace_back([this] { worker_main(); });
+        writer = std::thread([this] { writer_main(); });
+    }
+
+    void write(const char *__restrict s, size_t len) override {
+        check_failed();
+        while (len != 0) {
+            size_t n = std::min(len, block_size - raw.size());
+            raw.insert(raw.end(), s, s + n);
+            s += n;
+            len -= n;
+            if (raw.size() == block_size)
+                submit();
+        }
+    }
+
+    void putchar(char c) override {
+        check_failed();
+        raw.push_back(c);
+        if (raw.size() == block_size)
+            submit();
+    }
+
+    void flush() override {
+        drain();
+        try {
+            out->flush();
+        } catch (...) {
+            std::lock_guard<std::mutex> lck(mtx);
+            set_error(std::current_exception());
+            throw;
+        }
+    }
+
+    // 写结束块和索引。之前出过错时抛出那个错误，不写结束块，免得留下一个看起来完整的文件
+    void finish() {
+        check_failed();
+        if (finished)
+            return;
+        drain();
+        finished = true;
+        std::vector<char> tail;
+        write_end_block(tail);
+        size_t base = tail.size();
+        tail.resize(base + index.size() * 16 + kBlockIndexTrailerSize);
+        char *p = tail.data() + base;
+        for (auto const &e: index) {
+            store_le64(p, e.file_offset);
+            store_le64(p + 8, e.raw_offset);
+            p += 16;
+        }
+        store_le64(p, index.size());
+        memcpy(p + 8, kBlockIndexMagic, 8);
+        try {
+            out->write(tail.data(), tail.size());
+            out->flush();
+        } catch (...) {
+            std::lock_guard<std::mutex> lck(mtx);
+            set_error(std::current_exception());
+            throw;
+        }
+    }
+
+    ParallelCompressingOutStream(ParallelCompressingOutStream &&) = delete;
+
+    // 析构时的错误没法报告，想知道的话先自己调 finish()
+    ~ParallelCompressingOutStream() {
+        try {
+            finish();
+        } catch (...) {
+        }
+        stop_threads();
+    }
+};
+
+
+// 读文件末尾的块索引，没有索引返回空
+inline std::vector<BlockIndexEntry> load_block_index(int fd) {
+    std::vector<BlockIndexEntry> ret;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    uint64_t size = st.st_size;
+    char trailer[kBlockIndexTrailerSize];
+    if (size < kBlockIndexTrailerSize
+        || pread(fd, trailer, kBlockIndexTrailerSize, size - kBlockIndexTrailerSize) != (ssize_t)kBlockIndexTrailerSize
+        || memcmp(trailer + 8, kBlockIndexMagic, 8) != 0) {
+        return ret;
+    }
+    uint64_t count = load_le64(trailer);
+    if (count > (size - kBlockIndexTrailerSize) / 16) {
+        throw std::system_error(EBADMSG, std::generic_category());
+    }
+    std::vector<char> buf(count * 16);
+    ssize_t n = pread(fd, buf.data(), buf.size(), size - kBlockIndexTrailerSize - buf.size());
+    if (n != (ssize_t)buf.size()) {
+        throw std::system_error(EBADMSG, std::generic_category());
+    }
+    ret.resize(count);
+    for (uint64_t i = 0; i < count; ++i) {
+        ret[i].file_offset = load_le64(buf.data() + i * 16);
+        ret[i].raw_offset = load_le64(buf.data() + i * 16 + 8);
+    }
+    return ret;
+}
+
+inline std::unique_ptr<OutStream> out_file_open_parallel_compressed(const char *path, Codec codec = Codec::Lz,
+                                                                    size_t nthreads = std::thread::hardware_concurrency()) {
+    int fd = open(path, openFlagToUnixFlag.at(OpenFlag::Write), 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    auto file = std::make_unique<UnixFileOutStream>(fd);
+    return std::make_unique<ParallelCompressingOutStream>(std::move(file), codec, nthreads);
+}
+
+// 借助块索引，从解压后的第 raw_offset 字节开始读，只需解压一个块的前缀
+inline std::unique_ptr<InStream> in_file_open_compressed_at(const char *path, uint64_t raw_offset) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    auto file = std::make_unique<UnixFileInStream>(fd);
+    auto index = load_block_index(fd);
+    uint64_t skip = raw_offset;
+    auto it = std::upper_bound(index.begin(), index.end(), raw_offset,
+                               [](uint64_t off, BlockIndexEntry const &e) { return off < e.raw_offset; });
+    if (it != index.begin()) {
+        --it;
+        if (lseek(fd, it->file_offset, SEEK_SET) < 0) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        skip = raw_offset - it->raw_offset;
+    }
+    auto ret = std::make_unique<DecompressingInStream>(std::make_unique<BufferedInStream>(std::move(file)));
+    char scratch[4096];
+    while (skip != 0) {
+        size_t n = ret->read(scratch, std::min<uint64_t>(skip, sizeof scratch));
+        if (n == 0)
+            break;
+        skip -= n;
+    }
+    return ret;
+}
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <type_traits>
+#include "stream.h"
+#include "strview.h"
+
+// 按行处理的并行流水线：
+//
+//   lines(myin).parallel(8).map(f).filter(g).write_to(mout);
+//
+// 读的一方每次读一大块（默认 1MiB），截到最后一个换行，剩下的半行留给下一块；
+// 每一块交给一个工作线程依次跑所有 map / filter，结果按输入顺序写出（unordered() 时谁先做完先写谁）。
+// 块的输入输出缓冲区用完放回来复用，中间结果在每个线程自己的 scratch 里，每一行不分配内存。
+// 输出的每一行都以换行结尾，输入最后一行没有换行也会补上。
+//
+// map 可以是 std::string f(StrView)，方便但每行分配一次；
+// 也可以是 void f(StrView line, std::string &out)，往 out 里写结果，out 的容量一直复用。
+// filter 是 bool g(StrView)，返回 false 的行丢掉。它们会在多个线程里同时调用。
+
+struct LinePipeline {
+private:
+    // 处理一行，line 可能被换成指向 scratch 的内容；返回 false 表示这一行丢掉
+    using Stage = std::function<bool(StrView &line, std::string &scratch)>;
+
+    struct Batch {
+        uint64_t seq = 0;
+        std::vector<char> in;       // size() 是容量，有效的是前 len 个字节
+        size_t len = 0;
+        std::string out;
+        uint64_t lines = 0;
+    };
+
+    InStream &in;
+    size_t nthreads = std::thread::hardware_concurrency();
+    size_t batch_bytes = 1 << 20;
+    bool ordered = true;
+    std::vector<Stage> stages;
+
+    // 只有读的一方用
+    std::vector<char> carry;
+    bool eof = false;
+
+    void run_batch(Batch &b, std::vector<std::string> &scratch) const {
+        b.out.clear();
+        b.lines = 0;
+        const char *p = b.in.data();
+        const char *e = p + b.len;
+        while (p != e) {
+            const char *nl = (const char *)memchr(p, '\n', e - p);
+            const char *end = nl ? nl : e;
+            StrView line(p, end - p);
+            p = nl ? nl + 1 : e;
+            bool keep = true;
+            for (size_t i = 0; keep && i != stages.size(); i++)
+                keep = stages[i](line, scratch[i]);
+            if (keep) {
+                b.out.append(line.data(), line.size());
+                b.out += '\n';
+                ++b.lines;
+            }
+        }
+    }
+
+    // 读一块到 b，截到最后一个换行；一块里一个换行都没有就接着读，直到凑出完整的一行
+    [[nodiscard]] bool read_batch(Batch &b) {
+        b.len = carry.size();
+        if (b.in.size() < std::max(batch_bytes, b.len) + batch_bytes)
+            b.in.resize(std::max(batch_bytes, b.len) + batch_bytes);
+        if (!carry.empty())
+            memcpy(b.in.data(), carry.data(), carry.size());
+        carry.clear();
+        size_t scanned = b.len;     // 上一块剩下的半行里肯定没有换行
+        while (!eof) {
+            if (b.in.size() - b.len < batch_bytes)
+                b.in.resize(b.in.size() * 2);
+            size_t n = in.readn(b.in.data() + b.len, batch_bytes);
+            if (n < batch_bytes)
+                eof = true;
+            b.len += n;
+            if (eof)
+                break;
+            const char *p = b.in.data();
+            const char *nl = (const char *)memrchr(p + scanned, '\n', b.len - scanned);
+            if (nl != nullptr) {
+                carry.assign(nl + 1, p + b.len);
+                b.len = nl + 1 - p;
+                break;
+            }
+            scanned = b.len;
+        }
+        return b.len != 0;
+    }
+
+    uint64_t run_sequential(OutStream &out) {
+        Batch b;
+        std::vector<std::string> scratch(stages.size());
+        uint64_t total = 0;
+        while (read_batch(b)) {
+            run_batch(b, scratch);
+            out.write(b.out.data(), b.out.size());
+            total += b.lines;
+        }
+        return total;
+    }
+
+    uint64_t run_parallel(OutStream &out) {
+        std::mutex mtx;
+        std::condition_variable cv_job;
+        std::condition_variable cv_done;
+        std::deque<std::unique_ptr<Batch>> pending;
+        std::map<uint64_t, std::unique_ptr<Batch>> done;   // 乱序完成的块在这里排队
+        std::vector<std::unique_ptr<Batch>> free_batches;     // 只有读写的一方用，不用加锁
+        bool stopping = false;
+        std::exception_ptr error;
+
+        std::vector<std::thread> workers;
+        auto worker_main = [&] {
+            std::vector<std::string> scratch(stages.size());
+            std::unique_lock<std::mutex> lck(mtx);
+            while (true) {
+                cv_job.wait(lck, [&] { return stopping || !pending.empty(); });
+                if (pending.empty())
+                    return;
+                auto b = std::move(pending.front());
+                pending.pop_front();
+                lck.unlock();
+                try {
+                    run_batch(*b, scratch);
+                } catch (...) {
+                    lck.lock();
+                    if (!error)
+                        error = std::current_exception();
+                    b->out.clear();
+                    b->lines = 0;
+                    lck.unlock();
+                }
+                lck.lock();
+                done.emplace(b->seq, std::move(b));
+                cv_done.notify_one();
+            }
+        };
+        auto stop = [&] {
+            {
+                std::lock_guard<std::mutex> lck(mtx);
+                stopping = true;
+            }
+            cv_job.notify_all();
+            for (auto &t: workers)
+                t.join();
+        };
+
+        size_t max_inflight = nthreads * 2;
+        size_t inflight = 0;
+        uint64_t next_seq = 0;
+        uint64_t written_seq = 0;
+        uint64_t total = 0;
+        try {
+            for (size_t i = 0; i < nthreads; i++)
+                workers.emplace_back(worker_main);
+            bool more = true;
+            while (more || inflight != 0) {
+                std::unique_ptr<Batch> b;
+                {
+                    std::unique_lock<std::mutex> lck(mtx);
+                    auto ready = [&] {
+                        return !done.empty() && (!ordered || done.begin()->first == written_seq);
+                    };
+                    // 还能读就先去读，读满了或者读完了才等结果
+                    if (!(more && inflight < max_inflight))
+                        cv_done.wait(lck, [&] { return ready() || error; });
+                    if (error)
+                        break;
+                    if (ready()) {
+                        b = std::move(done.begin()->second);
+                        done.erase(done.begin());
+                    }
+                }
+                if (b) {
+                    // 做完的块：写出去，放回来复用
+                    out.write(b->out.data(), b->out.size());
+                    total += b->lines;
+                    ++written_seq;
+                    --inflight;
+                    free_batches.push_back(std::move(b));
+                    continue;
+                }
+                if (!free_batches.empty()) {
+                    b = std::move(free_batches.back());
+                    free_batches.pop_back();
+                } else {
+                    b = std::make_unique<Batch>();
+                }
+                if (!read_batch(*b)) {
+                    more = false;
+                    free_batches.push_back(std::move(b));
+                    continue;
+                }
+                b->seq = next_seq++;
+                ++inflight;
+                std::lock_guard<std::mutex> lck(mtx);
+                pending.push_back(std::move(b));
+                cv_job.notify_one();
+            }
+        } catch (...) {
+            stop();
+            throw;
+        }
+        stop();
+        if (error)
+            std::rethrow_exception(error);
+        return total;
+    }
+
+public:
+    explicit LinePipeline(InStream &in_) : in(in_) {
+    }
+
+    // n 个工作线程，1 表示就在调用 write_to 的线程里做
+    LinePipeline &parallel(size_t n) {
+        nthreads = std::max<size_t>(n, 1);
+        return *this;
+    }
+
+    // 每一块大概读多少字节
+    LinePipeline &batch(size_t bytes) {
+        batch_bytes = std::max<size_t>(bytes, 4096);
+        return *this;
+    }
+
+    // 不在乎输出顺序：哪一块先做完先写哪一块
+    LinePipeline &unordered() {
+        ordered = false;
+        return *this;
+    }
+
+    template <class F>
+    LinePipeline &map(F f) {
+        if constexpr (std::is_invocable_v<F &, StrView, std::string &>) {
+            stages.push_back([f](StrView &line, std::string &scratch) mutable {
+                scratch.clear();
+                f(line, scratch);
+                line = StrView(scratch);
+                return true;
+            });
+        } else {
+            stages.push_back([f](StrView &line, std::string &scratch) mutable {
+                scratch = f(line);
+                line = StrView(scratch);
+                return true;
+            });
+        }
+        return *this;
+    }
+
+    template <class G>
+    LinePipeline &filter(G g) {
+        stages.push_back([g](StrView &line, std::string &) mutable {
+            return (bool)g(line);
+        });
+        return *this;
+    }
+
+    // 跑完整个输入，返回写出去的行数。map / filter 抛出的第一个异常在所有线程停下之后重新抛出
+    uint64_t write_to(OutStream &out) {
+        if (nthreads <= 1)
+            return run_sequential(out);
+        return run_parallel(out);
+    }
+};
+
+inline LinePipeline lines(InStream &in) {
+    return LinePipeline(in);
+}
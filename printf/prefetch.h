@@ -0,0 +1,168 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include "stream.h"
+
+// 预读：消费者还在读这一块的时候，后台线程已经在把下一块读进另一个缓冲区。
+// 几百个输入共用一小组线程，不是每个流一个线程。
+
+struct PrefetchPool {
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> jobs;
+
+    explicit PrefetchPool(unsigned nthreads) {
+        for (unsigned i = 0; i < nthreads; i++) {
+            std::thread([this] {
+                while (true) {
+                    std::function<void()> job;
+                    {
+                        std::unique_lock<std::mutex> lock(mtx);
+                        cv.wait(lock, [&] { return !jobs.empty(); });
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                    }
+                    job();
+                }
+            }).detach();
+        }
+    }
+
+public:
+    // 和 BufferPool 一样故意不析构，线程一直挂着直到进程退出
+    static PrefetchPool &instance() {
+        static PrefetchPool *pool = new PrefetchPool(std::max(2u, std::thread::hardware_concurrency()));
+        return *pool;
+    }
+
+    void post(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            jobs.push_back(std::move(job));
+        }
+        cv.notify_one();
+    }
+
+    PrefetchPool(PrefetchPool &&) = delete;
+};
+
+// 两个缓冲区轮流用：一个交给消费者，另一个在后台 readn 读满。
+// 零拷贝接口和 BufferedInStream 一样：buffer() / buffered() / consume() / fill()
+struct PrefetchInStream : InStream {
+private:
+    std::unique_ptr<InStream> in;
+    size_t cap;
+    char *bufs[2];
+    int cur = 0;
+    size_t top = 0;
+    size_t max = 0;
+    bool eof = false;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool pending = false;
+    size_t next_n = 0;
+    std::exception_ptr error;
+
+    // 往消费者没在用的那个缓冲区里预读
+    void start_prefetch() {
+        pending = true;
+        char *dst = bufs[cur ^ 1];
+        PrefetchPool::instance().post([this, dst] {
+            size_t n = 0;
+            std::exception_ptr e;
+            try {
+                n = in->readn(dst, cap);
+            } catch (...) {
+                e = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            next_n = n;
+            error = e;
+            pending = false;
+            cv.notify_all();
+        });
+    }
+
+    void wait_prefetch() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return !pending; });
+    }
+
+    [[nodiscard]] bool refill() {
+        top = max = 0;
+        if (eof)
+            return false;
+        wait_prefetch();
+        if (error) {
+            eof = true;
+            std::rethrow_exception(error);
+        }
+        cur ^= 1;
+        max = next_n;
+        // readn 读不满说明到头了，不用再预读
+        if (max < cap)
+            eof = true;
+        else
+            start_prefetch();
+        return max != 0;
+    }
+
+public:
+    // 构造时就开始读第一块
+    explicit PrefetchInStream(std::unique_ptr<InStream> in_, size_t size = 64 * 1024)
+        : in(std::move(in_))
+        , cap(size)
+    {
+        bufs[0] = BufferPool::instance().allocate(cap);
+        bufs[1] = BufferPool::instance().allocate(cap);
+        start_prefetch();
+    }
+
+    char *buffer() {
+        return bufs[cur] + top;
+    }
+
+    size_t buffered() const {
+        return max - top;
+    }
+
+    void consume(size_t n) {
+        top += n;
+    }
+
+    [[nodiscard]] bool fill() {
+        if (top != max)
+            return true;
+        return refill();
+    }
+
+    int getchar() override {
+        if (!fill())
+            return EOF;
+        return (unsigned char)bufs[cur][top++];
+    }
+
+    size_t read(char *__restrict s, size_t len) override {
+        if (len == 0 || !fill())
+            return 0;
+        size_t n = std::min(len, max - top);
+        memcpy(s, bufs[cur] + top, n);
+        top += n;
+        return n;
+    }
+
+    PrefetchInStream(PrefetchInStream &&) = delete;
+
+    ~PrefetchInStream() {
+        wait_prefetch();
+        BufferPool::instance().release(bufs[0], cap);
+        BufferPool::instance().release(bufs[1], cap);
+    }
+};
@@ -0,0 +1,390 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+#include <system_error>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "stream.h"
+
+// 一批 (流, 缓冲区, 长度) 一起读，谁先读完谁先回调，不用一个一个地排队等 readn。
+// 底下是 fd 的流（batch_fd() >= 0）一次性提交给 io_uring，用文件当前位置读（和 read 一样会推进位置）；
+// 其他的流，或者内核不支持 io_uring 的时候，交给一组 I/O 线程各自阻塞地 readn。
+// 同一个流在一批里出现多次时按顺序一个接一个地读。
+// 每个请求都和 readn 一样尽量读满，n < len 表示遇到了 EOF。
+
+struct ReadRequest {
+    InStream *in;
+    char *buf;
+    size_t len;
+    size_t n = 0;
+};
+
+namespace uring {
+
+// 只用到 IORING_OP_READ 的最小封装，直接走系统调用，不依赖 liburing
+struct Ring {
+private:
+    int fd = -1;
+    unsigned entries = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes;
+    io_uring_cqe *cqes;
+    void *sq_ptr = MAP_FAILED;
+    void *cq_ptr = MAP_FAILED;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    unsigned to_submit = 0;
+
+    void unmap() {
+        if (sqes_size != 0)
+            munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED)
+            munmap(sq_ptr, sq_size);
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+
+public:
+    Ring() = default;
+
+    // 内核不支持（老内核、被 seccomp 禁用、没有按当前位置读的能力）时返回 false
+    bool init(unsigned n) {
+        io_uring_params p{};
+        fd = (int)syscall(__NR_io_uring_setup, n, &p);
+        if (fd < 0)
+            return false;
+        if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+            unmap();
+            return false;
+        }
+        entries = p.sq_entries;
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            unmap();
+            return false;
+        }
+        cq_ptr = single ? sq_ptr : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            unmap();
+            return false;
+        }
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        void *s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) {
+            sqes_size = 0;
+            unmap();
+            return false;
+        }
+        sqes = (io_uring_sqe *)s;
+        char *sq = (char *)sq_ptr;
+        sq_head = (unsigned *)(sq + p.sq_off.head);
+        sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned *)(sq + p.sq_off.array);
+        char *cq = (char *)cq_ptr;
+        cq_head = (unsigned *)(cq + p.cq_off.head);
+        cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    unsigned size() const {
+        return entries;
+    }
+
+    // SQ 满了返回 false，先 submit 再来
+    bool prep_read(int rfd, void *buf, unsigned len, uint64_t user_data) {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == entries)
+            return false;
+        unsigned idx = tail & *sq_mask;
+        io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = rfd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = len;
+        sqe->off = (uint64_t)-1;    // 用文件当前位置，管道和 socket 也一样
+        sqe->user_data = user_data;
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit;
+        return true;
+    }
+
+    // 提交攒着的 SQE，并等到至少 wait_nr 个完成
+    void submit_and_wait(unsigned wait_nr) {
+        while (true) {
+            int r = (int)syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (r >= 0) {
+                to_submit -= r;
+                return;
+            }
+            if (errno != EINTR) {
+                throw std::system_error(errno, std::generic_category());
+            }
+        }
+    }
+
+    // 取出所有已完成的，f(user_data, res)
+    template <class F>
+    void reap(F &&f) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            ++head;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            f(ud, res);
+        }
+    }
+
+    Ring(Ring &&) = delete;
+
+    ~Ring() {
+        unmap();
+    }
+};
+
+}
+
+struct BatchReader {
+private:
+    static constexpr uint64_t kWakeTag = ~(uint64_t)0;
+
+    uring::Ring ring;
+    bool use_ring;
+    int efd = -1;               // I/O 线程完成时写它，让等在 ring 上的调用者醒过来
+    bool efd_armed = false;     // ring 里有一个读 efd 的请求挂着
+    uint64_t efd_value;
+    unsigned nthreads;
+
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable cv_jobs;
+    std::condition_variable cv_done;
+    std::deque<std::function<void()>> jobs;
+    std::deque<size_t> done;
+    bool stop = false;
+
+    void worker() {
+        while (true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_jobs.wait(lock, [&] { return stop || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    void post(ReadRequest *r, size_t i, std::exception_ptr *err) {
+        if (workers.empty()) {
+            for (unsigned t = 0; t < nthreads; t++)
+                workers.emplace_back([this] { worker(); });
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            jobs.emplace_back([this, r, i, err] {
+                try {
+                    r->n += r->in->readn(r->buf + r->n, r->len - r->n);
+                } catch (...) {
+                    *err = std::current_exception();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    done.push_back(i);
+                }
+                cv_done.notify_one();
+                if (efd >= 0) {
+                    uint64_t one = 1;
+                    (void)!::write(efd, &one, sizeof(one));
+                }
+            });
+        }
+        cv_jobs.notify_one();
+    }
+
+public:
+    // nthreads 个 I/O 线程只在第一次需要时才启动
+    explicit BatchReader(unsigned ring_entries = 256, unsigned nthreads_ = 16)
+        : nthreads(nthreads_)
+    {
+        use_ring = ring.init(ring_entries);
+        if (use_ring) {
+            efd = eventfd(0, EFD_CLOEXEC);
+            if (efd < 0) {
+                throw std::system_error(errno, std::generic_category());
+            }
+        }
+    }
+
+    bool uses_io_uring() const {
+        return use_ring;
+    }
+
+    // 全部读完才返回。on_done 在调用线程上按完成的顺序调用，不要在里面抛异常。
+    // 出错的请求不回调，等整批结束后抛出第一个错误
+    void read_many(std::vector<ReadRequest> &reqs, std::function<void(ReadRequest &)> const &on_done = nullptr) {
+        size_t remaining = reqs.size();
+        std::vector<std::exception_ptr> errors(reqs.size());
+        std::unordered_map<InStream *, std::deque<size_t>> queues;
+        for (size_t i = 0; i < reqs.size(); i++) {
+            reqs[i].n = 0;
+            queues[reqs[i].in].push_back(i);
+        }
+        std::vector<int> fds(reqs.size(), -1);
+        std::deque<size_t> ring_pending;
+        size_t ring_inflight = 0;
+        size_t pool_inflight = 0;
+
+        auto start = [&](size_t i) {
+            ReadRequest &r = reqs[i];
+            if (r.n == r.len) {
+                // 长度为 0 的请求，直接算完成
+                std::lock_guard<std::mutex> lock(mtx);
+                done.push_back(i);
+                ++pool_inflight;
+                return;
+            }
+            int fd = use_ring ? r.in->batch_fd() : -1;
+            if (fd >= 0) {
+                fds[i] = fd;
+                ring_pending.push_back(i);
+            } else {
+                ++pool_inflight;
+                post(&r, i, &errors[i]);
+            }
+        };
+
+        auto finish = [&](size_t i) {
+            --remaining;
+            if (!errors[i] && on_done)
+                on_done(reqs[i]);
+            auto &q = queues[reqs[i].in];
+            q.pop_front();
+            if (!q.empty())
+                start(q.front());
+        };
+
+        for (auto &kv: queues)
+            start(kv.second.front());
+
+        while (remaining != 0) {
+            while (!ring_pending.empty()) {
+                size_t i = ring_pending.front();
+                ReadRequest &r = reqs[i];
+                unsigned len = (unsigned)std::min(r.len - r.n, (size_t)1 << 30);
+                if (!ring.prep_read(fds[i], r.buf + r.n, len, i))
+                    break;
+                ring_pending.pop_front();
+                ++ring_inflight;
+            }
+            if (pool_inflight != 0 && use_ring && !efd_armed && ring_inflight != 0) {
+                efd_armed = ring.prep_read(efd, &efd_value, sizeof(efd_value), kWakeTag);
+            }
+
+            bool have_done;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                have_done = !done.empty();
+            }
+            if (ring_inflight != 0 && !have_done) {
+                // I/O 线程那边完成的时候 efd 会把我们从这里叫醒
+                ring.submit_and_wait(1);
+            } else if (ring_inflight != 0) {
+                ring.submit_and_wait(0);
+            } else if (pool_inflight != 0) {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_done.wait(lock, [&] { return !done.empty(); });
+            }
+
+            if (use_ring) {
+                ring.reap([&](uint64_t ud, int res) {
+                    if (ud == kWakeTag) {
+                        efd_armed = false;
+                        return;
+                    }
+                    size_t i = ud;
+                    --ring_inflight;
+                    if (res == -EINTR) {
+                        ring_pending.push_back(i);
+                    } else if (res == -EAGAIN) {
+                        // 非阻塞 fd 上暂时没数据，交给 I/O 线程去等
+                        ++pool_inflight;
+                        post(&reqs[i], i, &errors[i]);
+                    } else if (res < 0) {
+                        errors[i] = std::make_exception_ptr(std::system_error(-res, std::generic_category()));
+                        finish(i);
+                    } else {
+                        reqs[i].n += res;
+                        if (res == 0 || reqs[i].n == reqs[i].len) {
+                            finish(i);
+                        } else {
+                            ring_pending.push_back(i);  // 读短了（管道、socket），接着读剩下的
+                        }
+                    }
+                });
+            }
+
+            std::deque<size_t> finished;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                finished.swap(done);
+            }
+            for (size_t i: finished) {
+                --pool_inflight;
+                finish(i);
+            }
+        }
+
+        for (auto &e: errors) {
+            if (e)
+                std::rethrow_exception(e);
+        }
+    }
+
+    BatchReader(BatchReader &&) = delete;
+
+    ~BatchReader() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stop = true;
+        }
+        cv_jobs.notify_all();
+        for (auto &t: workers)
+            t.join();
+        if (efd >= 0)
+            ::close(efd);
+    }
+};
+
+// 每个线程一个默认的 BatchReader
+inline void read_many(std::vector<ReadRequest> &reqs, std::function<void(ReadRequest &)> const &on_done = nullptr) {
+    static thread_local BatchReader reader;
+    reader.read_many(reqs, on_done);
+}
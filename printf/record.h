@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <system_error>
+#include "stream.h"
+#include "byteio.h"
+
+// 记录格式：每条 [varint(len + 1)][payload]，varint 0 表示记录结束。
+// 带索引时结束标记后跟块索引：N 个 [offset:u64][first_record:u64]，
+// 再跟 32 字节尾部 [records_end:u64][N:u64][total_records:u64]["RECIDX01"]。
+// 二进制数据不用再靠 getline 找分隔符，按索引一次 seek 就能跳到第 N 条附近。
+
+struct RecordBlockEntry {
+    uint64_t offset;
+    uint64_t first_record;
+};
+
+constexpr size_t kRecordTrailerSize = 32;
+constexpr char kRecordIndexMagic[8] = {'R', 'E', 'C', 'I', 'D', 'X', '0', '1'};
+
+struct RecordWriter {
+private:
+    std::unique_ptr<OutStream> out;
+    size_t block_bytes;
+    bool with_index;
+    bool finished = false;
+    uint64_t offset = 0;            // 假定从文件开头写
+    uint64_t block_start = 0;
+    uint64_t nrecords = 0;
+    std::vector<RecordBlockEntry> index;
+
+public:
+    explicit RecordWriter(std::unique_ptr<OutStream> out_, bool with_index_ = true, size_t block_bytes_ = 64 * 1024)
+        : out(std::move(out_))
+        , block_bytes(block_bytes_)
+        , with_index(with_index_)
+    {
+    }
+
+    void write(const char *s, size_t len) {
+        if (with_index && (index.empty() || offset - block_start >= block_bytes)) {
+            block_start = offset;
+            index.push_back({offset, nrecords});
+        }
+        char hdr[kMaxVarintSize];
+        size_t n = store_varint(hdr, (uint64_t)len + 1);
+        out->write(hdr, n);
+        out->write(s, len);
+        offset += n + len;
+        ++nrecords;
+    }
+
+    void write(std::string const &s) {
+        write(s.data(), s.size());
+    }
+
+    uint64_t count() const {
+        return nrecords;
+    }
+
+    void flush() {
+        out->flush();
+    }
+
+    void finish() {
+        if (finished)
+            return;
+        finished = true;
+        uint64_t records_end = offset;
+        std::string tail(1, '\0');
+        if (with_index) {
+            tail.resize(1 + index.size() * 16 + kRecordTrailerSize);
+            char *p = &tail[1];
+            for (auto const &e: index) {
+                store_le64(p, e.offset);
+                store_le64(p + 8, e.first_record);
+                p += 16;
+            }
+            store_le64(p, records_end);
+            store_le64(p + 8, index.size());
+            store_le64(p + 16, nrecords);
+            memcpy(p + 24, kRecordIndexMagic, 8);
+        }
+        out->write(tail.data(), tail.size());
+        out->flush();
+    }
+
+    RecordWriter(RecordWriter &&) = delete;
+
+    ~RecordWriter() {
+        finish();
+    }
+};
+
+
+struct RecordReader {
+private:
+    std::unique_ptr<InStream> in;
+    uint64_t next_record = 0;
+    bool eof = false;
+    bool index_loaded = false;
+    uint64_t records_end = 0;
+    uint64_t total_records = 0;
+    std::vector<RecordBlockEntry> index;
+
+    [[noreturn]] static void corrupt() {
+        throw std::system_error(EBADMSG, std::generic_category());
+    }
+
+    // 读 varint，开头就是 EOF 返回 false
+    bool read_varint(uint64_t &v) {
+        v = 0;
+        for (size_t i = 0; i < kMaxVarintSize; ++i) {
+            int c = in->getchar();
+            if (c == EOF) {
+                if (i == 0)
+                    return false;
+                corrupt();
+            }
+            v |= (uint64_t)(c & 0x7f) << (7 * i);
+            if (!(c & 0x80))
+                return true;
+        }
+        corrupt();
+    }
+
+    void reset_to(uint64_t off, uint64_t record) {
+        in->seek(off);
+        next_record = record;
+        eof = false;
+    }
+
+public:
+    explicit RecordReader(std::unique_ptr<InStream> in_)
+        : in(std::move(in_))
+    {
+    }
+
+    // 读下一条记录到 rec，没有了返回 false
+    bool next(std::string &rec) {
+        if (eof)
+            return false;
+        uint64_t v;
+        if (!read_varint(v) || v == 0) {
+            eof = true;
+            return false;
+        }
+        rec.resize(v - 1);
+        if (in->readn(&rec[0], rec.size()) != rec.size())
+            corrupt();
+        ++next_record;
+        return true;
+    }
+
+    // 下一次 next() 会读到的记录序号
+    uint64_t position() const {
+        return next_record;
+    }
+
+    // 读尾部的块索引，需要底层可以 seek，读完回到原来的位置
+    bool load_index() {
+        if (index_loaded)
+            return !index.empty();
+        index_loaded = true;
+        off_t pos = in->tell();
+        off_t end = in->seek(0, SEEK_END);
+        char trailer[kRecordTrailerSize];
+        if (end >= (off_t)kRecordTrailerSize) {
+            in->seek(end - kRecordTrailerSize);
+            if (in->readn(trailer, kRecordTrailerSize) == kRecordTrailerSize
+                && memcmp(trailer + 24, kRecordIndexMagic, 8) == 0) {
+                records_end = load_le64(trailer);
+                uint64_t nblocks = load_le64(trailer + 8);
+                total_records = load_le64(trailer + 16);
+                if (nblocks > (uint64_t)(end - kRecordTrailerSize) / 16)
+                    corrupt();
+                std::vector<char> buf(nblocks * 16);
+                in->seek(end - kRecordTrailerSize - buf.size());
+                if (in->readn(buf.data(), buf.size()) != buf.size())
+                    corrupt();
+                index.resize(nblocks);
+                for (uint64_t i = 0; i < nblocks; ++i) {
+                    index[i].offset = load_le64(buf.data() + i * 16);
+                    index[i].first_record = load_le64(buf.data() + i * 16 + 8);
+                }
+            }
+        }
+        in->seek(pos);
+        return !index.empty();
+    }
+
+    size_t block_count() {
+        load_index();
+        return index.size();
+    }
+
+    uint64_t record_count() {
+        load_index();
+        return total_records;
+    }
+
+    void seek_block(size_t b) {
+        if (!load_index() || b >= index.size())
+            throw std::system_error(EINVAL, std::generic_category());
+        reset_to(index[b].offset, index[b].first_record);
+    }
+
+    // 跳到第 n 条：一次 seek 到所在块的开头，再在块内往后跳；没有索引就从头扫
+    void seek_record(uint64_t n) {
+        if (!load_index()) {
+            reset_to(0, 0);
+        } else if (n >= total_records) {
+            reset_to(records_end, total_records);
+            return;
+        } else {
+            auto it = std::upper_bound(index.begin(), index.end(), n,
+                                       [](uint64_t r, RecordBlockEntry const &e) { return r < e.first_record; });
+            --it;
+            reset_to(it->offset, it->first_record);
+        }
+        std::string scratch;
+        while (next_record < n && next(scratch)) {
+        }
+    }
+
+    RecordReader(RecordReader &&) = delete;
+};
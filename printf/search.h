@@ -0,0 +1,226 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <system_error>
+#include "stream.h"
+#include "strview.h"
+#include "simd.h"
+
+// 字面量搜索，按行报告匹配，但不先把每一行切出来：
+// 直接在整块缓冲区里找下一个匹配，找到了才往前往后找换行定出那一行，然后从下一行开头接着找。
+// 没有匹配的大段文本只被 SIMD 扫一遍。
+//
+// 一个模式用 simd::find_substr（首尾字节过滤再校验）；
+// 多个模式用 Teddy：每个模式放进 8 个桶之一，用前两个字节的高低 4 位各查一张 16 项的表（pshufb），
+// 32 个位置一起算出“可能是哪些桶的开头”，只有这些位置才逐个 memcmp 桶里的模式。
+// 模式很多（几百个以上）的时候桶里太挤，校验会变多，那种情况该换 Aho-Corasick。
+
+struct Teddy {
+private:
+    static constexpr int kBuckets = 8;
+
+    // 两个 128 位通道各放一份，AVX2 的 pshufb 只在通道内查表
+    alignas(32) uint8_t lo0[32] = {};
+    alignas(32) uint8_t hi0[32] = {};
+    alignas(32) uint8_t lo1[32] = {};
+    alignas(32) uint8_t hi1[32] = {};
+    std::vector<uint32_t> buckets[kBuckets];
+    std::vector<std::string> const *pats = nullptr;
+
+    static void set(uint8_t *tbl, unsigned idx, uint8_t bit) {
+        tbl[idx] |= bit;
+        tbl[idx + 16] |= bit;
+    }
+
+    // 候选位置上 bits 里标出的桶逐个校验
+    const char *verify(const char *at, const char *end, unsigned bits, size_t *which) const {
+        while (bits != 0) {
+            unsigned b = __builtin_ctz(bits);
+            bits &= bits - 1;
+            for (uint32_t k: buckets[b]) {
+                std::string const &s = (*pats)[k];
+                if ((size_t)(end - at) >= s.size() && memcmp(at, s.data(), s.size()) == 0) {
+                    if (which)
+                        *which = k;
+                    return at;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    unsigned candidates(unsigned char c0, unsigned char c1) const {
+        return lo0[c0 & 15] & hi0[c0 >> 4] & lo1[c1 & 15] & hi1[c1 >> 4];
+    }
+
+    const char *find_scalar(const char *p, const char *end, size_t *which) const {
+        for (; p != end; ++p) {
+            // 最后一个字节后面没有第二个字节，当作什么都能配上，交给 verify 判断长度
+            unsigned bits = p + 1 != end ? candidates(p[0], p[1])
+                                         : lo0[(unsigned char)p[0] & 15] & hi0[(unsigned char)p[0] >> 4];
+            if (bits != 0) {
+                const char *m = verify(p, end, bits, which);
+                if (m)
+                    return m;
+            }
+        }
+        return nullptr;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("avx2")))
+    const char *find_avx2(const char *p, const char *end, size_t *which) const {
+        __m256i mask = _mm256_set1_epi8(0x0f);
+        __m256i tlo0 = _mm256_load_si256((const __m256i *)lo0);
+        __m256i thi0 = _mm256_load_si256((const __m256i *)hi0);
+        __m256i tlo1 = _mm256_load_si256((const __m256i *)lo1);
+        __m256i thi1 = _mm256_load_si256((const __m256i *)hi1);
+        __m256i zero = _mm256_setzero_si256();
+        alignas(32) uint8_t res[32];
+        while (end - p >= 33) {
+            __m256i x0 = _mm256_loadu_si256((const __m256i *)p);
+            __m256i x1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+            __m256i r0 = _mm256_and_si256(_mm256_shuffle_epi8(tlo0, _mm256_and_si256(x0, mask)),
+                                          _mm256_shuffle_epi8(thi0, _mm256_and_si256(_mm256_srli_epi16(x0, 4), mask)));
+            __m256i r1 = _mm256_and_si256(_mm256_shuffle_epi8(tlo1, _mm256_and_si256(x1, mask)),
+                                          _mm256_shuffle_epi8(thi1, _mm256_and_si256(_mm256_srli_epi16(x1, 4), mask)));
+            __m256i r = _mm256_and_si256(r0, r1);
+            unsigned m = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(r, zero));
+            if (m != 0) {
+                _mm256_store_si256((__m256i *)res, r);
+                while (m != 0) {
+                    unsigned i = __builtin_ctz(m);
+                    m &= m - 1;
+                    const char *hit = verify(p + i, end, res[i], which);
+                    if (hit)
+                        return hit;
+                }
+            }
+            p += 32;
+        }
+        return find_scalar(p, end, which);
+    }
+#endif
+
+public:
+    // patterns 要活得比 Teddy 长，而且都不能为空
+    void build(std::vector<std::string> const &patterns) {
+        pats = &patterns;
+        for (uint32_t k = 0; k < patterns.size(); k++) {
+            std::string const &s = patterns[k];
+            uint8_t bit = 1u << (k % kBuckets);
+            buckets[k % kBuckets].push_back(k);
+            unsigned char c0 = s[0];
+            set(lo0, c0 & 15, bit);
+            set(hi0, c0 >> 4, bit);
+            if (s.size() >= 2) {
+                unsigned char c1 = s[1];
+                set(lo1, c1 & 15, bit);
+                set(hi1, c1 >> 4, bit);
+            } else {
+                // 只有一个字节的模式，第二个字节是什么都行
+                for (unsigned v = 0; v < 16; v++) {
+                    set(lo1, v, bit);
+                    set(hi1, v, bit);
+                }
+            }
+        }
+    }
+
+    const char *find(const char *p, const char *end, size_t *which) const {
+#if defined(__x86_64__)
+        if (simd::has_avx2())
+            return find_avx2(p, end, which);
+#endif
+        return find_scalar(p, end, which);
+    }
+};
+
+struct Searcher {
+private:
+    std::vector<std::string> pats;
+    Teddy teddy;
+
+public:
+    // 模式不能为空，也不能包含换行（匹配按行报告）
+    explicit Searcher(std::vector<std::string> patterns) : pats(std::move(patterns)) {
+        if (pats.empty())
+            throw std::system_error(EINVAL, std::generic_category(), "no pattern");
+        for (auto const &s: pats) {
+            if (s.empty() || s.find('\n') != std::string::npos)
+                throw std::system_error(EINVAL, std::generic_category(), "bad pattern");
+        }
+        if (pats.size() > 1)
+            teddy.build(pats);
+    }
+
+    Searcher(Searcher &&) = delete;
+
+    size_t patterns() const {
+        return pats.size();
+    }
+
+    // [p, end) 里最左边的匹配，which 设成匹配上的是第几个模式；没有返回 nullptr
+    const char *find(const char *p, const char *end, size_t *which = nullptr) const {
+        if (pats.size() == 1) {
+            if (which)
+                *which = 0;
+            return simd::find_substr(p, end, pats[0].data(), pats[0].size());
+        }
+        return teddy.find(p, end, which);
+    }
+
+    // 在 [p, end) 里找所有包含匹配的行，p 必须是某一行的开头。
+    // on_match(StrView line, uint64_t offset, size_t which)：line 不含换行，offset 是 base 加上行首在块里的位置
+    template <class F>
+    uint64_t scan_lines(const char *p, const char *end, uint64_t base, F &&on_match) const {
+        const char *begin = p;
+        uint64_t n = 0;
+        while (p < end) {
+            size_t which = 0;
+            const char *m = find(p, end, &which);
+            if (m == nullptr)
+                break;
+            const char *ls = (const char *)memrchr(p, '\n', m - p);
+            ls = ls ? ls + 1 : p;
+            const char *le = (const char *)memchr(m, '\n', end - m);
+            le = le ? le : end;
+            on_match(StrView(ls, le - ls), base + (ls - begin), which);
+            ++n;
+            p = le == end ? end : le + 1;
+        }
+        return n;
+    }
+
+    // 从流里一块一块读着找，块截在最后一个换行，剩下的半行留给下一块；一行比一块还长就继续读
+    template <class F>
+    uint64_t scan(InStream &in, F &&on_match, size_t chunk = 1 << 20) const {
+        std::vector<char> buf(2 * chunk);
+        size_t len = 0;         // buf 里有效的字节
+        uint64_t base = 0;      // buf[0] 在流里的偏移
+        uint64_t n = 0;
+        bool eof = false;
+        while (!eof) {
+            if (buf.size() - len < chunk)
+                buf.resize(buf.size() * 2);
+            size_t got = in.readn(buf.data() + len, chunk);
+            eof = got < chunk;
+            len += got;
+            size_t cut = len;
+            if (!eof) {
+                const char *nl = (const char *)memrchr(buf.data(), '\n', len);
+                if (nl == nullptr)
+                    continue;
+                cut = nl + 1 - buf.data();
+            }
+            n += scan_lines(buf.data(), buf.data() + cut, base, on_match);
+            memmove(buf.data(), buf.data() + cut, len - cut);
+            len -= cut;
+            base += cut;
+        }
+        return n;
+    }
+};
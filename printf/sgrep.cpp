@@ -0,0 +1,150 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <string>
+#include <charconv>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "stream.h"
+#include "mmapstream.h"
+#include "search.h"
+
+// 按字面量搜索文件，输出包含任意一个模式的行，和 grep -F 一样。
+// 普通文件 mmap 进来整块扫，stdin 和管道按块读着扫。
+//
+// 用法：sgrep [-b] [-c] [-H] [-e 模式]... [模式] [文件...]
+//   -b  每行前面加上行首的字节偏移
+//   -c  只输出匹配的行数
+//   -H  每行前面加上文件名（多个文件时默认就加）
+// 有匹配返回 0，没有返回 1，出错返回 2。
+
+static void usage() {
+    fprintf(stderr, "usage: sgrep [-b] [-c] [-H] [-e pattern]... [pattern] [file...]\n");
+    exit(2);
+}
+
+struct Options {
+    std::vector<std::string> patterns;
+    std::vector<const char *> inputs;
+    bool offsets = false;
+    bool count = false;
+    bool names = false;
+};
+
+// 直接写进缓冲区而不用 message()：写出错（磁盘满、管道断了）要抛到 main 里去报告，不能在析构里吞掉
+static void put_uint(OutStream &out, uint64_t v) {
+    char b[24];
+    out.write(b, std::to_chars(b, b + sizeof(b), v).ptr - b);
+}
+
+struct Printer {
+    Options const &opt;
+    OutStream &out;
+    const char *name;
+
+    void operator()(StrView line, uint64_t offset, size_t) {
+        if (opt.names) {
+            out.puts(name);
+            out.putchar(':');
+        }
+        if (opt.offsets) {
+            put_uint(out, offset);
+            out.putchar(':');
+        }
+        out.write(line.data(), line.size());
+        out.putchar('\n');
+    }
+};
+
+static uint64_t search_one(Searcher const &s, Options const &opt, OutStream &out, const char *path) {
+    const char *name = path ? path : "(standard input)";
+    Printer print{opt, out, name};
+    auto count_only = [](StrView, uint64_t, size_t) {};
+    uint64_t n;
+    struct stat st;
+    if (path != nullptr && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        auto in = in_file_open_mmap(path);
+        const char *p = in->data();
+        if (opt.count)
+            n = s.scan_lines(p, p + in->size(), 0, count_only);
+        else
+            n = s.scan_lines(p, p + in->size(), 0, print);
+    } else {
+        std::unique_ptr<InStream> in = path ? in_file_open(path, OpenFlag::Read)
+                                            : std::make_unique<UnixFileInStream>(dup(STDIN_FILENO));
+        if (opt.count)
+            n = s.scan(*in, count_only);
+        else
+            n = s.scan(*in, print);
+    }
+    if (opt.count) {
+        if (opt.names) {
+            out.puts(name);
+            out.putchar(':');
+        }
+        put_uint(out, n);
+        out.putchar('\n');
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    Options opt;
+    int c;
+    while ((c = getopt(argc, argv, "bcHe:h")) != -1) {
+        switch (c) {
+        case 'b':
+            opt.offsets = true;
+            break;
+        case 'c':
+            opt.count = true;
+            break;
+        case 'H':
+            opt.names = true;
+            break;
+        case 'e':
+            opt.patterns.push_back(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    int i = optind;
+    if (opt.patterns.empty()) {
+        if (i == argc)
+            usage();
+        opt.patterns.push_back(argv[i++]);
+    }
+    for (; i < argc; i++)
+        opt.inputs.push_back(argv[i]);
+    if (opt.inputs.size() > 1)
+        opt.names = true;
+
+    uint64_t total = 0;
+    bool failed = false;
+    try {
+        Searcher s(opt.patterns);
+        BufferedOutStream out(std::make_unique<UnixFileOutStream>(dup(STDOUT_FILENO)), BufferedOutStream::FullBuf, nullptr, 64 * 1024);
+        if (opt.inputs.empty())
+            total += search_one(s, opt, out, nullptr);
+        for (const char *path: opt.inputs) {
+            try {
+                total += search_one(s, opt, out, path);
+            } catch (std::system_error const &e) {
+                // 先看是不是输出坏了：是的话这里会再抛一次，到外面报告并退出，不再接着搜别的文件
+                out.flush();
+                fprintf(stderr, "sgrep: %s: %s\n", path, e.what());
+                failed = true;
+            }
+        }
+        out.flush();
+    } catch (std::exception const &e) {
+        fprintf(stderr, "sgrep: %s\n", e.what());
+        return 2;
+    }
+    if (failed)
+        return 2;
+    return total != 0 ? 0 : 1;
+}
@@ -0,0 +1,242 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// 一次比较 32 个字节（AVX2）或 16 个字节（SSE2），找出第一个属于给定字符集合的位置，
+// 或者第一次出现某个子串的位置，或者数某个字节出现了几次。AVX2 在运行时检测，编译时不需要 -mavx2。找不到返回 nullptr。
+
+namespace simd {
+
+#if defined(__x86_64__)
+inline bool has_avx2() {
+    static const bool ok = __builtin_cpu_supports("avx2");
+    return ok;
+}
+
+__attribute__((target("avx2")))
+inline const char *find_any2_avx2(const char *p, const char *end, char a, char b) {
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(x, vb)));
+        if (m != 0)
+            return p + __builtin_ctz(m);
+        p += 32;
+    }
+    for (; p != end; ++p)
+        if (*p == a || *p == b)
+            return p;
+    return nullptr;
+}
+
+__attribute__((target("avx2")))
+inline const char *find_any3_avx2(const char *p, const char *end, char a, char b, char c) {
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    __m256i vc = _mm256_set1_epi8(c);
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i e = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(x, vb)),
+                                    _mm256_cmpeq_epi8(x, vc));
+        unsigned m = (unsigned)_mm256_movemask_epi8(e);
+        if (m != 0)
+            return p + __builtin_ctz(m);
+        p += 32;
+    }
+    for (; p != end; ++p)
+        if (*p == a || *p == b || *p == c)
+            return p;
+    return nullptr;
+}
+
+// 子串查找：同时比较每个候选位置上的首字节和末字节，两个都对上的才 memcmp 中间部分。
+// 只看首字节的话，日志里常见的字母几乎处处是候选；首尾一起比，候选少一两个数量级。
+// 调用前保证 n >= 2 且 end - p >= n
+__attribute__((target("avx2")))
+inline const char *find_substr_avx2(const char *p, const char *end, const char *s, size_t n) {
+    __m256i first = _mm256_set1_epi8(s[0]);
+    __m256i last = _mm256_set1_epi8(s[n - 1]);
+    const char *stop = end - n + 1;     // 匹配起点的上界（不含）
+    while (stop - p >= 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + n - 1));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (m != 0) {
+            unsigned i = __builtin_ctz(m);
+            if (memcmp(p + i + 1, s + 1, n - 2) == 0)
+                return p + i;
+            m &= m - 1;
+        }
+        p += 32;
+    }
+    for (; p != stop; ++p)
+        if (*p == s[0] && memcmp(p + 1, s + 1, n - 1) == 0)
+            return p;
+    return nullptr;
+}
+
+// 数一数有多少个字节等于 c：每 32 个字节比较一次，movemask 成 32 位再 popcount
+__attribute__((target("avx2,popcnt")))
+inline size_t count_byte_avx2(const char *p, const char *end, char c) {
+    __m256i vc = _mm256_set1_epi8(c);
+    size_t n = 0;
+    while (end - p >= 128) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), vc);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), vc);
+        __m256i x = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 64)), vc);
+        __m256i y = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 96)), vc);
+        uint64_t lo = (uint32_t)_mm256_movemask_epi8(a) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32);
+        uint64_t hi = (uint32_t)_mm256_movemask_epi8(x) | ((uint64_t)(uint32_t)_mm256_movemask_epi8(y) << 32);
+        n += __builtin_popcountll(lo) + __builtin_popcountll(hi);
+        p += 128;
+    }
+    while (end - p >= 32) {
+        n += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), vc)));
+        p += 32;
+    }
+    for (; p != end; ++p)
+        n += *p == c;
+    return n;
+}
+#endif
+
+inline const char *find_any2_sse2(const char *p, const char *end, char a, char b) {
+#if defined(__x86_64__)
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)));
+        if (m != 0)
+            return p + __builtin_ctz(m);
+        p += 16;
+    }
+#endif
+    for (; p != end; ++p)
+        if (*p == a || *p == b)
+            return p;
+    return nullptr;
+}
+
+inline const char *find_any3_sse2(const char *p, const char *end, char a, char b, char c) {
+#if defined(__x86_64__)
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    __m128i vc = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)p);
+        __m128i e = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)), _mm_cmpeq_epi8(x, vc));
+        unsigned m = (unsigned)_mm_movemask_epi8(e);
+        if (m != 0)
+            return p + __builtin_ctz(m);
+        p += 16;
+    }
+#endif
+    for (; p != end; ++p)
+        if (*p == a || *p == b || *p == c)
+            return p;
+    return nullptr;
+}
+
+inline const char *find_substr_sse2(const char *p, const char *end, const char *s, size_t n) {
+    const char *stop = end - n + 1;
+#if defined(__x86_64__)
+    __m128i first = _mm_set1_epi8(s[0]);
+    __m128i last = _mm_set1_epi8(s[n - 1]);
+    while (stop - p >= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + n - 1));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (m != 0) {
+            unsigned i = __builtin_ctz(m);
+            if (memcmp(p + i + 1, s + 1, n - 2) == 0)
+                return p + i;
+            m &= m - 1;
+        }
+        p += 16;
+    }
+#endif
+    for (; p != stop; ++p)
+        if (*p == s[0] && memcmp(p + 1, s + 1, n - 1) == 0)
+            return p;
+    return nullptr;
+}
+
+inline size_t count_byte_sse2(const char *p, const char *end, char c) {
+    size_t n = 0;
+#if defined(__x86_64__)
+    __m128i vc = _mm_set1_epi8(c);
+    while (end - p >= 16) {
+        n += __builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), vc)));
+        p += 16;
+    }
+#endif
+    for (; p != end; ++p)
+        n += *p == c;
+    return n;
+}
+
+inline const char *find_any2(const char *p, const char *end, char a, char b) {
+#if defined(__x86_64__)
+    if (has_avx2())
+        return find_any2_avx2(p, end, a, b);
+#endif
+    return find_any2_sse2(p, end, a, b);
+}
+
+inline const char *find_any3(const char *p, const char *end, char a, char b, char c) {
+#if defined(__x86_64__)
+    if (has_avx2())
+        return find_any3_avx2(p, end, a, b, c);
+#endif
+    return find_any3_sse2(p, end, a, b, c);
+}
+
+inline char *find_any2(char *p, char *end, char a, char b) {
+    return const_cast<char *>(find_any2((const char *)p, (const char *)end, a, b));
+}
+
+inline char *find_any3(char *p, char *end, char a, char b, char c) {
+    return const_cast<char *>(find_any3((const char *)p, (const char *)end, a, b, c));
+}
+
+// 在 [p, end) 里找子串 s[0, n)，n 为 0 时返回 p
+inline const char *find_substr(const char *p, const char *end, const char *s, size_t n) {
+    if ((size_t)(end - p) < n)
+        return nullptr;
+    if (n == 0)
+        return p;
+    if (n == 1)
+        return (const char *)memchr(p, s[0], end - p);
+#if defined(__x86_64__)
+    if (has_avx2())
+        return find_substr_avx2(p, end, s, n);
+#endif
+    return find_substr_sse2(p, end, s, n);
+}
+
+inline size_t count_byte(const char *p, const char *end, char c) {
+#if defined(__x86_64__)
+    if (has_avx2())
+        return count_byte_avx2(p, end, c);
+#endif
+    return count_byte_sse2(p, end, c);
+}
+
+// 单个字符 glibc 的 memchr 已经是向量化的
+inline const char *find_byte(const char *p, const char *end, char c) {
+    return (const char *)memchr(p, c, end - p);
+}
+
+inline char *find_byte(char *p, char *end, char c) {
+    return (char *)memchr(p, c, end - p);
+}
+
+}
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <utility>
+#include <system_error>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include "stream.h"
+
+// TCP 和 Unix 域 socket 上的流，和文件一样套一层 BufferedInStream / BufferedOutStream 用。
+// 一个连接的读写两端共用一个 fd，最后一个流析构时才关闭。
+// BufferedOutStream 缓冲区满时用 write_more，这里变成 MSG_MORE，让内核把小段攒成整包；
+// 显式 flush 或者行缓冲遇到换行才真正推出去。
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+struct Socket {
+    int fd;
+
+    explicit Socket(int fd_) : fd(fd_) {
+    }
+
+    Socket(Socket &&) = delete;
+
+    ~Socket() {
+        ::close(fd);
+    }
+};
+
+struct SocketInStream : InStream {
+private:
+    std::shared_ptr<Socket> sock;
+
+    ssize_t do_recv(char *s, size_t len, int flags) {
+        while (true) {
+            ssize_t n = ::recv(sock->fd, s, len, flags);
+            if (n >= 0)
+                return n;
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+public:
+    explicit SocketInStream(std::shared_ptr<Socket> sock_) : sock(std::move(sock_)) {
+    }
+
+    int get_fd() const {
+        return sock->fd;
+    }
+
+    int batch_fd() override {
+        return sock->fd;
+    }
+
+    size_t read(char *__restrict s, size_t len) override {
+        return do_recv(s, len, 0);
+    }
+
+    // MSG_WAITALL 让内核攒够了再返回；被信号打断或者对端关闭时可能不够，剩下的接着收
+    size_t readn(char *__restrict s, size_t len) override {
+        size_t n = 0;
+        while (n != len) {
+            ssize_t m = do_recv(s + n, len - n, MSG_WAITALL);
+            if (m == 0)
+                break;
+            n += m;
+        }
+        return n;
+    }
+};
+
+struct SocketOutStream : OutStream {
+private:
+    std::shared_ptr<Socket> sock;
+    size_t zerocopy_min = 0;    // 0 表示不用 MSG_ZEROCOPY
+    uint32_t zc_sent = 0;       // 已经发出的零拷贝 send 次数，内核按这个编号回通知
+    uint32_t zc_done = 0;       // 已经收到完成通知的编号上界
+
+    void send_all(const char *s, size_t len, int flags) {
+        bool zc = zerocopy_min != 0 && len >= zerocopy_min;
+        while (len != 0) {
+            ssize_t n = ::send(sock->fd, s, len, flags | MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (zc && errno == ENOBUFS) {
+                    // optmem 不够钉住更多页，这次退回普通拷贝
+                    zc = false;
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category());
+            }
+            if (zc)
+                ++zc_sent;
+            s += n;
+            len -= n;
+        }
+        // 内核还引用着调用者的缓冲区，write 返回后调用者就会改它，所以要等通知回来
+        if (zc_done != zc_sent)
+            reap_zerocopy();
+    }
+
+    void reap_zerocopy() {
+        while (zc_done != zc_sent) {
+            char control[128];
+            msghdr msg{};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (::recvmsg(sock->fd, &msg, MSG_ERRQUEUE) < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // 错误队列可读时 poll 报 POLLERR，不需要在 events 里请求
+                    poll_fd(sock->fd, 0);
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category());
+            }
+            for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c != nullptr; c = CMSG_NXTHDR(&msg, c)) {
+                auto *ee = (sock_extended_err *)CMSG_DATA(c);
+                if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                    continue;
+                // [ee_info, ee_data] 这一段编号完成了，通知按顺序到达
+                zc_done = ee->ee_data + 1;
+            }
+        }
+    }
+
+public:
+    explicit SocketOutStream(std::shared_ptr<Socket> sock_) : sock(std::move(sock_)) {
+    }
+
+    int get_fd() const {
+        return sock->fd;
+    }
+
+    // 单次写入不小于 min_len 的走 MSG_ZEROCOPY，只对大块有利（要钉页、收通知）。
+    // 只有 TCP 支持，不支持时返回 false，继续普通拷贝
+    bool enable_zerocopy(size_t min_len = 64 * 1024) {
+        int one = 1;
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+            return false;
+        zerocopy_min = min_len;
+        return true;
+    }
+
+    void write(const char *__restrict s, size_t len) override {
+        send_all(s, len, 0);
+    }
+
+    void write_more(const char *__restrict s, size_t len) override {
+        send_all(s, len, MSG_MORE);
+    }
+};
+
+inline void set_tcp_nodelay(int fd, bool on) {
+    int v = on;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v)) < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+}
+
+// host 为 nullptr 时监听所有地址，port 为 0 时由系统挑一个，用 socket_local_port 查
+inline int tcp_listen(const char *host, uint16_t port, int backlog = 128) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *res;
+    std::string service = std::to_string(port);
+    int err = getaddrinfo(host, service.c_str(), &hints, &res);
+    if (err != 0) {
+        throw std::system_error(EHOSTUNREACH, std::generic_category(), gai_strerror(err));
+    }
+    int fd = -1;
+    int saved = 0;
+    for (addrinfo *a = res; a != nullptr; a = a->ai_next) {
+        fd = ::socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) {
+            saved = errno;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (::bind(fd, a->ai_addr, a->ai_addrlen) == 0 && ::listen(fd, backlog) == 0)
+            break;
+        saved = errno;
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        throw std::system_error(saved, std::generic_category());
+    }
+    return fd;
+}
+
+inline uint16_t socket_local_port(int fd) {
+    sockaddr_storage ss{};
+    socklen_t len = sizeof(ss);
+    if (getsockname(fd, (sockaddr *)&ss, &len) < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    if (ss.ss_family == AF_INET6)
+        return ntohs(((sockaddr_in6 *)&ss)->sin6_port);
+    return ntohs(((sockaddr_in *)&ss)->sin_port);
+}
+
+// 我们自己有缓冲，交给内核的都是整块，Nagle 只会多等一个 RTT，所以默认关掉
+inline int tcp_connect(const char *host, uint16_t port, bool nodelay = true) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res;
+    std::string service = std::to_string(port);
+    int err = getaddrinfo(host, service.c_str(), &hints, &res);
+    if (err != 0) {
+        throw std::system_error(EHOSTUNREACH, std::generic_category(), gai_strerror(err));
+    }
+    int fd = -1;
+    int saved = 0;
+    for (addrinfo *a = res; a != nullptr; a = a->ai_next) {
+        fd = ::socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) {
+            saved = errno;
+            continue;
+        }
+        int r;
+        while ((r = ::connect(fd, a->ai_addr, a->ai_addrlen)) < 0 && errno == EINTR)
+            ;
+        if (r == 0)
+            break;
+        saved = errno;
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        throw std::system_error(saved, std::generic_category());
+    }
+    if (nodelay)
+        set_tcp_nodelay(fd, true);
+    return fd;
+}
+
+// TCP 连接会设置 TCP_NODELAY，Unix 域 socket 没有这个选项
+inline int socket_accept(int lfd, bool nodelay = true) {
+    int fd;
+    while ((fd = ::accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC)) < 0) {
+        if (errno != EINTR && errno != ECONNABORTED)
+            throw std::system_error(errno, std::generic_category());
+    }
+    sockaddr_storage ss{};
+    socklen_t len = sizeof(ss);
+    if (nodelay && getsockname(fd, (sockaddr *)&ss, &len) == 0
+            && (ss.ss_family == AF_INET || ss.ss_family == AF_INET6)) {
+        set_tcp_nodelay(fd, true);
+    }
+    return fd;
+}
+
+inline sockaddr_un unix_address(const char *path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        throw std::system_error(ENAMETOOLONG, std::generic_category());
+    }
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+// 已经存在的 socket 文件会先删掉
+inline int unix_listen(const char *path, int backlog = 128) {
+    sockaddr_un addr = unix_address(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    ::unlink(path);
+    if (::bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(fd, backlog) < 0) {
+        int saved = errno;
+        ::close(fd);
+        throw std::system_error(saved, std::generic_category());
+    }
+    return fd;
+}
+
+inline int unix_connect(const char *path) {
+    sockaddr_un addr = unix_address(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    int r;
+    while ((r = ::connect(fd, (sockaddr *)&addr, sizeof(addr))) < 0 && errno == EINTR)
+        ;
+    if (r < 0) {
+        int saved = errno;
+        ::close(fd);
+        throw std::system_error(saved, std::generic_category());
+    }
+    return fd;
+}
+
+struct SocketStreams {
+    std::shared_ptr<Socket> sock;
+    std::unique_ptr<BufferedInStream> in;
+    std::unique_ptr<BufferedOutStream> out;
+
+    // 写完了：推出缓冲区并通知对端 EOF，读的一端还能接着用
+    void shutdown() {
+        out->flush();
+        if (::shutdown(sock->fd, SHUT_WR) < 0) {
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+};
+
+// 接管 fd，返回带缓冲的读写两端。zerocopy_min 不为 0 时尝试对大块写入开启 MSG_ZEROCOPY
+inline SocketStreams socket_streams(int fd, BufferedOutStream::BufferMode mode = BufferedOutStream::FullBuf,
+                                    size_t zerocopy_min = 0) {
+    SocketStreams s;
+    s.sock = std::make_shared<Socket>(fd);
+    auto out = std::make_unique<SocketOutStream>(s.sock);
+    if (zerocopy_min != 0)
+        out->enable_zerocopy(zerocopy_min);
+    s.in = std::make_unique<BufferedInStream>(std::make_unique<SocketInStream>(s.sock));
+    s.out = std::make_unique<BufferedOutStream>(std::move(out), mode);
+    return s;
+}
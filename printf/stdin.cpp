@@ -3,6 +3,7 @@
 #include <string>
 #include <unistd.h>
 #include <termios.h>
+#include "utf8.h"
 
 struct StdinRawify {
     struct termios oldtc;
@@ -27,27 +28,61 @@ struct StdinRawify {
     }
 };
 
+// max_size 按字节算，但只存完整的字符：放不下的字符整个丢掉，返回的总是合法的 UTF-8
 std::string input_password(const char *prompt, size_t max_size = static_cast<size_t>(-1)) {
     if (prompt) {
         fprintf(stderr, "%s", prompt);
     }
 
     std::string ret;
+    int pending = 0;        // 最后一个字符还差几个后续字节
+    bool dropping = false;  // 当前字符已经丢掉了，它的后续字节也跟着丢
+    // 最后一个字符没收完整就被打断了，把已经存下的那几个字节和显示的 * 一起去掉
+    auto drop_partial = [&] {
+        if (pending == 0)
+            return;
+        while (((unsigned char)ret.back() & 0xc0) == 0x80)
+            ret.pop_back();
+        ret.pop_back();
+        pending = 0;
+        fprintf(stderr, "\b \b");
+    };
     StdinRawify stdinRawifier;
     while (true) {
         int c = getchar();
-        if (c == EOF)   break;
+        if (c == EOF) {
+            drop_partial();
+            break;
+        }
         if (c == '\n' || c == '\r') {
+            drop_partial();
             fputc('\n', stderr);
             break;
         } else if (c == '\b' || c == '\x7f') {
+            pending = 0;
+            dropping = false;
             if (ret.size() > 0) {
+                // 退格删掉整个字符，UTF-8 的多字节字符不能只删最后一个字节
+                while (ret.size() > 1 && ((unsigned char)ret.back() & 0xc0) == 0x80)
+                    ret.pop_back();
                 ret.pop_back();
                 fprintf(stderr, "\b \b");
             }
+        } else if (((unsigned char)c & 0xc0) == 0x80) {
+            // 后续字节：属于存下来的字符就存，前面的字符丢掉了或者没有开头的就丢
+            if (pending > 0 && !dropping) {
+                ret.push_back(c);
+                --pending;
+            }
         } else {
-            if (ret.size() < max_size) {
+            drop_partial();
+            int n = utf8::seq_length(c);
+            // 不合法的开头字节和放不下的字符都整个丢掉，一个 * 也不显示
+            dropping = n == 0 || ret.size() + n > max_size;
+            if (!dropping) {
                 ret.push_back(c);
+                pending = n - 1;
+                // 一个字符只显示一个 *
                 fputc('*', stderr);
             }
         }
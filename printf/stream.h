@@ -0,0 +1,1135 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <thread>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <climits>
+#include <poll.h>
+#include <cerrno>
+#include <functional>
+#include <system_error>
+#include <map>
+#include <exception>
+#include <vector>
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+#include <charconv>
+#include <type_traits>
+#include "bufpool.h"
+
+// 非阻塞 fd 上的一次尝试：Ok 表示有进展（n 可能小于请求的长度），WouldBlock 表示现在做不了（EAGAIN）
+enum class IoStatus {
+    Ok,
+    WouldBlock,
+    Eof,
+};
+
+struct IoResult {
+    size_t n;
+    IoStatus status;
+};
+
+inline void set_fd_nonblocking(int fd, bool on) {
+    int fl = fcntl(fd, F_GETFL);
+    if (fl < 0 || fcntl(fd, F_SETFL, on ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK)) < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+}
+
+// 等 fd 就绪，超时返回 false
+inline bool poll_fd(int fd, short events, int timeout_ms = -1) {
+    pollfd p{fd, events, 0};
+    while (true) {
+        int r = ::poll(&p, 1, timeout_ms);
+        if (r >= 0)
+            return r > 0;
+        if (errno != EINTR)
+            throw std::system_error(errno, std::generic_category());
+    }
+}
+
+// 阻塞接口遇到 EAGAIN 时怎么等：默认 poll，挂在事件循环下面的时候可以换成自己的
+using WaitHook = std::function<void(int fd, short events)>;
+
+struct InStream {
+    virtual size_t read(char *__restrict s, size_t len) = 0;
+    virtual ~InStream() = default;
+
+    virtual int getchar() {
+        char c;
+        size_t n = read(&c, 1);
+        if (n == 0) {
+            return EOF;
+        }
+        return (unsigned char)c;
+    }
+
+    virtual size_t readn(char *__restrict s, size_t len) {
+        size_t n = read(s, len);
+        if (n == 0) return 0;
+        while (n != len) {
+            size_t m = read(s + n, len - n);
+            if (m == 0) break;
+            n += m;
+        }
+        return n;
+    }
+
+    std::string readall() {
+        std::string ret;
+        ret.resize(32);
+        size_t pos = 0;
+        while (true) {
+            // resize 后缓冲区会搬家，每次重新取地址
+            size_t n = read(&ret[0] + pos, ret.size() - pos);
+            if (n == 0) {
+                break;
+            }
+            pos += n;
+            if (pos == ret.size()) {
+                ret.resize(ret.size() * 2);
+            }
+        }
+        ret.resize(pos);
+        return ret;
+    }
+
+    std::string readuntil(char eol) {
+        std::string ret;
+        while (true) {
+            int c = getchar();
+            if (c == EOF) {
+                break;
+            }
+            ret.push_back(c);
+            if (c == eol) {
+                break;
+            }
+        }
+        return ret;
+    }
+
+    std::string readuntil(const char *__restrict eol, size_t neol) {
+        std::string ret;
+        while (true) {
+            int c = getchar();
+            if (c == EOF) {
+                break;
+            }
+            ret.push_back(c);
+            if (ret.size() >= neol) {
+                if (memcmp(ret.data() + ret.size() - neol, eol, neol) == 0) {
+                    break;
+                }
+            }
+        }
+        return ret;
+    }
+
+    std::string readuntil(std::string const &eol) {
+        return readuntil(eol.data(), eol.size());
+    }
+
+
+    std::string getline(char eol) {
+        std::string ret = readuntil(eol);
+        if (ret.size() > 0 && ret.back() == eol)
+            ret.pop_back();
+        return ret;
+    }
+
+    std::string getline(const char *__restrict eol, size_t neol) {
+        std::string ret = readuntil(eol, neol);
+        if (ret.size() >= neol && memcmp(ret.data() + ret.size() - neol, eol, neol) == 0)
+            ret.resize(ret.size() - neol);
+        return ret;
+    }
+
+    std::string getline(std::string const &eol) {
+        return getline(eol.data(), eol.size());
+    }
+
+    // 随机访问，不支持的流（管道、解压流等）和 lseek 一样报 ESPIPE
+    virtual off_t seek(off_t offset, int whence = SEEK_SET) {
+        (void)offset;
+        (void)whence;
+        throw std::system_error(ESPIPE, std::generic_category());
+    }
+
+    off_t tell() {
+        return seek(0, SEEK_CUR);
+    }
+
+    // 底下直接就是一个 fd、自己手里也没有缓冲着的数据时返回这个 fd，
+    // read_many 可以绕过流直接对它批量发起读（见 readmany.h）；做不到的返回 -1
+    virtual int batch_fd() {
+        return -1;
+    }
+};
+
+
+struct UnixFileInStream : InStream {
+private:
+    int fd;
+    WaitHook wait_hook;
+
+public:
+    explicit UnixFileInStream(int fd_, bool nonblock = false) : fd(fd_) {
+        if (nonblock) {
+            set_fd_nonblocking(fd, true);
+        }
+    }
+
+    int get_fd() const {
+        return fd;
+    }
+
+    int batch_fd() override {
+        return fd;
+    }
+
+    void set_nonblocking(bool on) {
+        set_fd_nonblocking(fd, on);
+    }
+
+    void set_wait_hook(WaitHook hook) {
+        wait_hook = std::move(hook);
+    }
+
+    // 只做一次 read，不等待；非阻塞 fd 上没数据时返回 WouldBlock
+    IoResult try_read(char *__restrict s, size_t len) {
+        if (len == 0)   return {0, IoStatus::Ok};
+        while (true) {
+            ssize_t n = ::read(fd, s, len);
+            if (n > 0) {
+                return {(size_t)n, IoStatus::Ok};
+            }
+            if (n == 0) {
+                return {0, IoStatus::Eof};
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return {0, IoStatus::WouldBlock};
+            }
+            throw std::system_error(errno, std::generic_category());
+        }
+    }
+
+    // 阻塞语义：非阻塞 fd 上会等到可读为止
+    size_t read(char *__restrict s, size_t len) override {
+        if (len == 0)   return 0;
+        while (true) {
+            IoResult r = try_read(s, len);
+            if (r.status != IoStatus::WouldBlock) {
+                return r.n;
+            }
+            if (wait_hook) {
+                wait_hook(fd, POLLIN);
+            } else {
+                poll_fd(fd, POLLIN);
+            }
+        }
+    }
+
+    off_t seek(off_t offset, int whence = SEEK_SET) override {
+        off_t pos = ::lseek(fd, offset, whence);
+        if (pos < 0) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        return pos;
+    }
+
+    UnixFileInStream(UnixFileInStream &&) = delete;
+
+    ~UnixFileInStream() {
+        ::close(fd);
+    }
+};
+
+
+struct BufferedInStream : InStream {
+private:
+    std::unique_ptr<InStream> in;
+    char *buf;
+    size_t cap;
+    size_t top = 0;
+    size_t max = 0;
+    PageBacking backing;
+
+    [[nodiscard]] bool refill() {
+        top = 0;
+        max = in->read(buf, cap);
+        // max <= cap
+        return max != 0;
+    }
+
+public:
+    // 超过 1MiB 的缓冲区用大页（见 bufpool.h）
+    explicit BufferedInStream(std::unique_ptr<InStream> in_, size_t size = BUFSIZ)
+        : in(std::move(in_))
+        , cap(size)
+    {
+        buf = BufferPool::instance().allocate(cap, &backing);
+    }
+
+    size_t capacity() const {
+        return cap;
+    }
+
+    PageBacking page_backing() const {
+        return backing;
+    }
+
+    int getchar() override {
+        if (top == max) {
+            if (!refill())
+                return EOF;
+        }
+        return (unsigned char)buf[top++];
+    }
+
+    // 零拷贝访问：buffer() 开始的 buffered() 个字节是还没读的部分，consume(n) 表示读掉了 n 个
+    char *buffer() {
+        return buf + top;
+    }
+
+    size_t buffered() const {
+        return max - top;
+    }
+
+    void consume(size_t n) {
+        top += n;
+    }
+
+    // 缓冲区空着的时候直接读下层不会乱序
+    int batch_fd() override {
+        return top == max ? in->batch_fd() : -1;
+    }
+
+    // 缓冲区读空了才去下层读，EOF 返回 false
+    [[nodiscard]] bool fill() {
+        if (top != max)
+            return true;
+        return refill();
+    }
+
+    size_t read(char *__restrict s, size_t len) override {
+        // 如果缓冲区为空，则阻塞，否则尽量不阻塞，返回已缓冲的字符
+        char *__restrict p = s;
+        while (p != s + len) {
+            if (top == max) {
+                if (p != s || !refill())
+                    break;
+            }
+            int c = buf[top++];
+            *p++ = c;
+        }
+        return p - s;
+    }
+
+    size_t readn(char *__restrict s, size_t len) override {
+        // 尽量读满 len 个字符，除非遇到 EOF，才会返回小于 len 的值
+        char *__restrict p = s;
+        while (p != s + len) {
+            if (top == max) {
+                // 剩下的比一个缓冲区还大，直接让下层读满，不经过缓冲区
+                if ((size_t)(s + len - p) >= cap)
+                    return p - s + in->readn(p, s + len - p);
+                if (!refill())
+                    break;
+            }
+            int c = buf[top++];
+            *p++ = c;
+        }
+        return p - s;
+    }
+
+    off_t seek(off_t offset, int whence = SEEK_SET) override {
+        // 下层的位置比我们交出去的多了缓冲区里没读的部分
+        if (whence == SEEK_CUR) {
+            offset -= (off_t)(max - top);
+        }
+        off_t pos = in->seek(offset, whence);
+        top = max = 0;
+        return pos;
+    }
+
+    BufferedInStream(BufferedInStream &&) = delete;
+
+    ~BufferedInStream() {
+        BufferPool::instance().release(buf, cap);
+    }
+};
+
+
+struct OutStream {
+    virtual void write(const char *__restrict s, size_t len) = 0;
+
+    virtual ~OutStream() = default;
+
+    void puts(const char *__restrict s) {
+        write(s, strlen(s));
+    }
+
+    virtual void putchar(char c) {
+        write(&c, 1);
+    }
+
+    // 输出到终端上的流，BufferedOutStream 的 Adaptive 模式据此选择行缓冲
+    virtual bool is_terminal() {
+        return false;
+    }
+
+    // 和 write 一样，但提示后面马上还有数据，下层可以先攒着不急着发出去（比如 socket 的 MSG_MORE）
+    virtual void write_more(const char *__restrict s, size_t len) {
+        write(s, len);
+    }
+
+    virtual void flush() {
+
+    }
+
+    // 几段数据当作一次写出去：能 writev 的下层一次系统调用写完，别的线程的输出插不到中间
+    virtual void writev(const struct iovec *iov, int iovcnt) {
+        for (int i = 0; i < iovcnt; i++) {
+            if (i + 1 != iovcnt)
+                write_more((const char *)iov[i].iov_base, iov[i].iov_len);
+            else
+                write((const char *)iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+
+    struct Message;
+
+    // auto m = merr.message(); m << "open: " << strerror(errno) << "\n"; 离开作用域时一次写出
+    Message message();
+};
+
+// 攒在栈上的一条消息，离开作用域时用一次 writev 交给流，这时的写错误会被忽略，显式调 send() 才会抛出。
+// 只记指针不拷贝，所以片段（包括 strerror 返回的）要活到消息发出去；数字格式化到自带的小缓冲区里。
+// 片段超过 16 个或者小缓冲区用完时，整条消息改成拼在堆上的一个 string 里，最后还是一次 write 写出，不会被拆开
+struct OutStream::Message {
+private:
+    static constexpr int kMaxParts = 16;
+
+    OutStream &out;
+    struct iovec parts[kMaxParts];
+    int nparts = 0;
+    char scratch[128];
+    size_t used = 0;
+    std::string heap;
+    bool spilled = false;   // 已经改成拼在 heap 里了
+
+    // 已有的片段拷进 heap，之后的内容都直接追加到 heap
+    void spill() {
+        for (int i = 0; i < nparts; i++)
+            heap.append((const char *)parts[i].iov_base, parts[i].iov_len);
+        nparts = 0;
+        used = 0;
+        spilled = true;
+    }
+
+    // 放进 scratch 的内容紧跟在上一段后面的话就并进上一段。
+    // 调用前要保证片段没满
+    Message &append_scratch(const char *s, size_t len) {
+        if (nparts != 0 && (char *)parts[nparts - 1].iov_base + parts[nparts - 1].iov_len == s) {
+            parts[nparts - 1].iov_len += len;
+            return *this;
+        }
+        return append(s, len);
+    }
+
+public:
+    explicit Message(OutStream &out_) : out(out_) {
+    }
+
+    Message &append(const char *s, size_t len) {
+        if (!spilled && nparts == kMaxParts)
+            spill();
+        if (spilled)
+            heap.append(s, len);
+        else
+            parts[nparts++] = {(void *)s, len};
+        return *this;
+    }
+
+    Message &operator<<(const char *s) {
+        return append(s, strlen(s));
+    }
+
+    Message &operator<<(std::string const &s) {
+        return append(s.data(), s.size());
+    }
+
+    Message &operator<<(std::string &&s) = delete;  // 临时的 string 活不到发出去
+
+    Message &operator<<(char c) {
+        if (!spilled && (used == sizeof(scratch) || nparts == kMaxParts))
+            spill();
+        if (spilled) {
+            heap.push_back(c);
+            return *this;
+        }
+        scratch[used] = c;
+        return append_scratch(scratch + used++, 1);
+    }
+
+    template <class T> requires (std::is_integral_v<T> && !std::is_same_v<T, char> && !std::is_same_v<T, bool>)
+    Message &operator<<(T v) {
+        if (!spilled && (sizeof(scratch) - used < 24 || nparts == kMaxParts))
+            spill();
+        if (spilled) {
+            char b[24];
+            heap.append(b, std::to_chars(b, b + sizeof(b), v).ptr - b);
+            return *this;
+        }
+        char *p = scratch + used;
+        char *e = std::to_chars(p, scratch + sizeof(scratch), v).ptr;
+        used += e - p;
+        return append_scratch(p, e - p);
+    }
+
+    // 立刻发出去，写失败时抛出异常；不管成没成功，这条消息都算发过了，不会再发第二次
+    void send() {
+        int n = nparts;
+        nparts = 0;
+        used = 0;
+        if (spilled) {
+            std::string s = std::move(heap);
+            heap.clear();
+            spilled = false;
+            out.write(s.data(), s.size());
+        } else if (n != 0) {
+            out.writev(parts, n);
+        }
+    }
+
+    Message(Message &&) = delete;
+
+    // 析构里不能抛，写失败只能吞掉（比如 stderr 关掉了）；要知道有没有写成功就自己先调 send()
+    ~Message() {
+        try {
+            send();
+        } catch (...) {
+        }
+    }
+};
+
+inline OutStream::Message OutStream::message() {
+    return Message(*this);
+}
+
+struct UnixFileOutStream : OutStream {
+private:
+    int fd;
+    WaitHook wait_hook;
+
+public:
+    explicit UnixFileOutStream(int fd_, bool nonblock = false) : fd(fd_) {
+        if (nonblock) {
+            set_fd_nonblocking(fd, true);
+        }
+    }
+
+    int get_fd() const {
+        return fd;
+    }
+
+    bool is_terminal() override {
+        return isatty(fd);
+    }
+
+    void set_nonblocking(bool on) {
+        set_fd_nonblocking(fd, on);
+    }
+
+    void set_wait_hook(WaitHook hook) {
+        wait_hook = std::move(hook);
+    }
+
+    // 尽量写，直到写完或者 EAGAIN；n 是已经写出去的字节数，WouldBlock 时剩下的要等可写了再来
+    IoResult try_write(const char *__restrict s, size_t len) {
+        size_t written = 0;
+        while (written != len) {
+            ssize_t n = ::write(fd, s + written, len - written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return {written, IoStatus::WouldBlock};
+                }
+                throw std::system_error(errno, std::generic_category());
+            }
+            if (n == 0) {
+                throw std::system_error(EPIPE, std::generic_category());
+            }
+            written += n;
+        }
+        return {written, IoStatus::Ok};
+    }
+
+    void wait_writable() {
+        if (wait_hook) {
+            wait_hook(fd, POLLOUT);
+        } else {
+            poll_fd(fd, POLLOUT);
+        }
+    }
+
+    // 阻塞着写完，非阻塞 fd 上 EAGAIN 就等可写
+    void write_all(const char *__restrict s, size_t len) {
+        while (true) {
+            IoResult r = try_write(s, len);
+            if (r.status == IoStatus::Ok) {
+                return;
+            }
+            s += r.n;
+            len -= r.n;
+            wait_writable();
+        }
+    }
+
+    void write(const char *__restrict s, size_t len) override {
+        if (len == 0)   return;
+        write_all(s, len);
+    }
+
+    void writev(const struct iovec *iov, int iovcnt) override {
+        while (true) {
+            while (iovcnt > 0 && iov->iov_len == 0) {
+                ++iov;
+                --iovcnt;
+            }
+            if (iovcnt == 0)
+                return;
+            ssize_t n = ::writev(fd, iov, std::min(iovcnt, IOV_MAX));
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    wait_writable();
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category());
+            }
+            if (n == 0)
+                throw std::system_error(EPIPE, std::generic_category());
+            // 跳过写完的段；写了一半的那段剩下的单独补上，不改调用者的 iovec
+            size_t done = n;
+            while (iovcnt > 0 && done >= iov->iov_len) {
+                done -= iov->iov_len;
+                ++iov;
+                --iovcnt;
+            }
+            if (done != 0) {
+                write_all((const char *)iov->iov_base + done, iov->iov_len - done);
+                ++iov;
+                --iovcnt;
+            }
+        }
+    }
+
+    UnixFileOutStream(UnixFileOutStream &&) = delete;
+
+    ~UnixFileOutStream() {
+        ::close(fd);
+    }
+};
+
+struct FlushScheduler;
+
+// 挂到 FlushScheduler 上的流才需要加锁，其他的流只多一次空指针判断
+struct MaybeLock {
+    std::mutex *m;
+
+    explicit MaybeLock(std::mutex *m_) : m(m_) {
+        if (m)
+            m->lock();
+    }
+
+    MaybeLock(MaybeLock &&) = delete;
+
+    ~MaybeLock() {
+        if (m)
+            m->unlock();
+    }
+};
+
+// 缓冲模式、缓冲区和后台刷新这些跟策略无关的部分；具体怎么缓冲看 BasicBufferedOutStream 的 Policy
+struct BufferedOutBase : OutStream {
+    enum BufferMode {
+        FullBuf,
+        LineBuf,
+        NoBuf,
+        Adaptive,   // 和 glibc 的 stdout 一样，终端上行缓冲，文件和管道上全缓冲；再加上时间预算
+    };
+
+protected:
+    friend struct FlushScheduler;
+
+    std::unique_ptr<OutStream> out;
+    size_t top = 0;
+    char *buf;
+    size_t cap;
+    bool owns_buf = false;  // 调用者传进来的缓冲区不归我们释放
+    PageBacking backing = PageBacking::Normal;
+
+    // 后台定时刷新用（见 FlushScheduler）
+    std::unique_ptr<std::mutex> guard;
+    uint64_t flushes = 0;               // 写出去过几次，后台线程据此判断数据是不是一直没动过
+    std::exception_ptr bg_error;        // 后台刷新时的错误，留到下一次调用时抛出
+
+    BufferedOutBase(std::unique_ptr<OutStream> out_, char *buf_, size_t size)
+        : out(std::move(out_))
+        , buf(buf_)
+        , cap(size)
+    {}
+
+    // 只有真要缓冲的时候才分配，NoBuf 的流一个字节都不占
+    void allocate_buf() {
+        if (buf == nullptr) {
+            buf = BufferPool::instance().allocate(cap, &backing);
+            owns_buf = true;
+        }
+    }
+
+    void flush_buf() {
+        out->write(buf, top);
+        top = 0;
+        ++flushes;
+    }
+
+    // 缓冲区满了被迫写出去，后面还有数据
+    void flush_more() {
+        out->write_more(buf, top);
+        top = 0;
+        ++flushes;
+    }
+
+    void check_bg_error() {
+        if (bg_error)
+            std::rethrow_exception(std::exchange(bg_error, nullptr));
+    }
+
+    void schedule_flush(std::chrono::milliseconds deadline);
+
+public:
+    // 缓冲区的大小，也就是攒到多少字节就写出去
+    size_t capacity() const {
+        return cap;
+    }
+
+    PageBacking page_backing() const {
+        return backing;
+    }
+
+    BufferedOutBase(BufferedOutBase &&) = delete;
+
+    ~BufferedOutBase();
+};
+
+// 缓冲策略。编译期就定下来的模式不用每次写都判断，
+// FixedBuffering<NoBuf> 的流不分配缓冲区，写入直接转给下层
+struct DynamicBuffering {
+    static constexpr bool fixed = false;
+};
+
+template <BufferedOutBase::BufferMode M>
+struct FixedBuffering {
+    static_assert(M != BufferedOutBase::Adaptive, "Adaptive 要看运行时的 isatty，只能用 DynamicBuffering");
+    static constexpr bool fixed = true;
+    static constexpr BufferedOutBase::BufferMode mode = M;
+};
+
+using FullBuffering = FixedBuffering<BufferedOutBase::FullBuf>;
+using LineBuffering = FixedBuffering<BufferedOutBase::LineBuf>;
+using NoBuffering = FixedBuffering<BufferedOutBase::NoBuf>;
+
+template <class Policy = DynamicBuffering>
+struct BasicBufferedOutStream : BufferedOutBase {
+private:
+    BufferMode dyn_mode = FullBuf;  // 只有 DynamicBuffering 用
+
+    // Adaptive 选了全缓冲时，缓冲区里的数据最多放 budget 这么久：
+    // 挂到 FlushScheduler 上，后面没有写入了也会被后台线程推出去；写入时顺便也看一眼，到点了就自己推
+    bool timed = false;
+    std::chrono::milliseconds budget{100};
+    std::chrono::steady_clock::time_point dirty_since;
+
+    BufferMode mode() const {
+        if constexpr (Policy::fixed)
+            return Policy::mode;
+        else
+            return dyn_mode;
+    }
+
+    void mark_dirty() {
+        if (timed && top == 0)
+            dirty_since = std::chrono::steady_clock::now();
+    }
+
+    void check_budget() {
+        if (timed && top != 0 && std::chrono::steady_clock::now() - dirty_since >= budget)
+            flush_buf();
+    }
+
+public:
+    // buf_ 不为空时 size 是它的大小；超过 1MiB 的自有缓冲区用大页
+    explicit BasicBufferedOutStream(std::unique_ptr<OutStream> out_, BufferMode mode_ = FullBuf, char *buf_ = nullptr, size_t size = BUFSIZ) requires (!Policy::fixed)
+            : BufferedOutBase(std::move(out_), buf_, size)
+            , dyn_mode(mode_)
+    {
+        if (dyn_mode == Adaptive) {
+            dyn_mode = out->is_terminal() ? LineBuf : FullBuf;
+            timed = dyn_mode == FullBuf;
+        }
+        if (dyn_mode != NoBuf)
+            allocate_buf();
+        if (timed)
+            schedule_flush(budget);
+    }
+
+    explicit BasicBufferedOutStream(std::unique_ptr<OutStream> out_, char *buf_ = nullptr, size_t size = BUFSIZ) requires Policy::fixed
+            : BufferedOutBase(std::move(out_), buf_, size)
+    {
+        if constexpr (Policy::mode != NoBuf)
+            allocate_buf();
+    }
+
+    // Adaptive 实际选中的模式
+    BufferMode get_mode() const {
+        return mode();
+    }
+
+    // 只对 Adaptive 选了全缓冲的流有效
+    void set_flush_budget(std::chrono::milliseconds ms) {
+        budget = ms;
+        if (timed)
+            schedule_flush(budget);
+    }
+
+    // 交给后台线程保证：数据在缓冲区里最多放 deadline 这么久。
+    // 之后这个流的读写会加锁，但仍然只能有一个线程往里写
+    void flush_within(std::chrono::milliseconds deadline) {
+        if (mode() != NoBuf)
+            schedule_flush(deadline);
+    }
+
+    // NoBuf 的流不会挂到后台线程上，也就不用加锁、不用看 bg_error
+    void flush() override {
+        if (mode() == NoBuf) {
+            out->flush();
+            return;
+        }
+        MaybeLock lock(guard.get());
+        check_bg_error();
+        flush_buf();
+    }
+
+    void putchar(char c) override {
+        if (mode() == NoBuf) {
+            out->write(&c, 1);
+            return;
+        }
+        MaybeLock lock(guard.get());
+        check_bg_error();
+        if (top == cap) {
+            flush_more();
+        }
+        mark_dirty();
+        buf[top++] = c;
+        if (mode() == LineBuf && c == '\n') {
+            flush_buf();
+        } else if (c == '\n') {
+            check_budget();
+        }
+    }
+
+    void write(const char *__restrict s, size_t len) override {
+        if (mode() == NoBuf) {
+            out->write(s, len);
+            return;
+        }
+        MaybeLock lock(guard.get());
+        check_bg_error();
+        if (len >= cap) {
+            // 大块直接交给下层，省一次拷贝，下层也能一次看到整块（比如走 MSG_ZEROCOPY）
+            if (top != 0)
+                flush_more();
+            out->write(s, len);
+            return;
+        }
+        mark_dirty();
+        for (const char *__restrict p = s; p != s + len; ++p) {
+            if (top == cap) {
+                flush_more();
+                mark_dirty();
+            }
+            char c = *p;
+            buf[top++] = c;
+            if (mode() == LineBuf && c == '\n') {
+                flush_buf();
+            }
+        }
+        check_budget();
+    }
+
+    // 整条消息一起进缓冲区，放不下就先把缓冲区写出去；比整个缓冲区还大就直接交给下层的 writev
+    void writev(const struct iovec *iov, int iovcnt) override {
+        if (mode() == NoBuf) {
+            out->writev(iov, iovcnt);
+            return;
+        }
+        MaybeLock lock(guard.get());
+        check_bg_error();
+        size_t len = 0;
+        for (int i = 0; i < iovcnt; i++)
+            len += iov[i].iov_len;
+        if (top + len > cap && top != 0)
+            flush_more();
+        if (len >= cap) {
+            out->writev(iov, iovcnt);
+            return;
+        }
+        mark_dirty();
+        bool newline = false;
+        for (int i = 0; i < iovcnt; i++) {
+            memcpy(buf + top, iov[i].iov_base, iov[i].iov_len);
+            if (mode() == LineBuf && !newline)
+                newline = memchr(buf + top, '\n', iov[i].iov_len) != nullptr;
+            top += iov[i].iov_len;
+        }
+        if (newline)
+            flush_buf();
+        else
+            check_budget();
+    }
+
+    BasicBufferedOutStream(BasicBufferedOutStream &&) = delete;   // 有析构需要去除移动函数，删除这一个即可删除其他三个
+};
+
+// 模式运行时才知道（比如 Adaptive）就用这个
+using BufferedOutStream = BasicBufferedOutStream<>;
+
+// 一个后台线程定时检查所有挂上来的 BufferedOutStream，数据放得太久的替它们 flush。
+// 写的一方不用为每一行付一次系统调用，也不用自己看时间。
+// 每个流每 deadline / 2 检查一次：连续两次看到缓冲区里有数据、中间又没有写出去过，
+// 说明最早的那部分数据已经放了至少 deadline / 2、至多 deadline，就刷掉。
+//
+// 定时的线程只负责挑出到点的流，检查和刷新交给工作线程，做的时候不拿全局的锁：
+// 一个写得慢或者卡住的下层只占住一个工作线程，别的流照样按时刷，attach / detach 也不用等。
+// 工作线程都忙着时再开一个，闲下来的留着给下次用。
+// 流自己的锁只 try_lock，拿不到（写的一方正在写）就过一会儿再来。
+struct FlushScheduler {
+private:
+    struct Entry {
+        BufferedOutBase *s;
+        std::chrono::milliseconds period;
+        std::chrono::steady_clock::time_point next;
+        uint64_t seen_flushes = 0;
+        bool seen_dirty = false;
+        bool in_flight = false;     // 交给工作线程了还没做完，这时不能摘掉
+    };
+
+    static constexpr std::chrono::milliseconds kRetry{1};
+
+    std::mutex mtx;
+    std::condition_variable cv;         // 叫醒定时的线程
+    std::condition_variable cv_job;     // 叫醒工作线程
+    std::condition_variable cv_idle;    // 某个流做完了，detach 可能在等
+    std::vector<std::unique_ptr<Entry>> entries;
+    std::deque<Entry *> jobs;
+    size_t idle_workers = 0;
+    bool started = false;
+
+    FlushScheduler() = default;
+
+    // 不持有 mtx 调用，in_flight 保证 e 不会被摘掉。流正在被别人用时返回 false
+    bool check(Entry &e) {
+        BufferedOutBase &s = *e.s;
+        std::unique_lock<std::mutex> lock(*s.guard, std::try_to_lock);
+        if (!lock.owns_lock())
+            return false;
+        if (s.top == 0 || s.bg_error) {
+            e.seen_dirty = false;
+            return true;
+        }
+        if (e.seen_dirty && e.seen_flushes == s.flushes) {
+            try {
+                s.flush_buf();
+            } catch (...) {
+                s.bg_error = std::current_exception();
+            }
+            e.seen_dirty = false;
+            return true;
+        }
+        e.seen_dirty = true;
+        e.seen_flushes = s.flushes;
+        return true;
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            ++idle_workers;
+            cv_job.wait(lock, [&] { return !jobs.empty(); });
+            --idle_workers;
+            Entry *e = jobs.front();
+            jobs.pop_front();
+            lock.unlock();
+            bool done = check(*e);
+            lock.lock();
+            e->in_flight = false;
+            e->next = std::chrono::steady_clock::now() + (done ? e->period : std::min(e->period, kRetry));
+            cv_idle.notify_all();
+            cv.notify_one();
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            bool any = false;
+            std::chrono::steady_clock::time_point wake;
+            for (auto &e: entries) {
+                if (e->in_flight)
+                    continue;
+                wake = any ? std::min(wake, e->next) : e->next;
+                any = true;
+            }
+            if (!any) {
+                cv.wait(lock);
+                continue;
+            }
+            if (cv.wait_until(lock, wake) == std::cv_status::no_timeout)
+                continue;   // 有流挂上来、摘掉了或者做完了，重新算
+            auto now = std::chrono::steady_clock::now();
+            for (auto &e: entries) {
+                if (e->in_flight || e->next > now)
+                    continue;
+                e->in_flight = true;
+                jobs.push_back(e.get());
+                if (idle_workers < jobs.size())
+                    std::thread([this] { worker(); }).detach();
+                cv_job.notify_one();
+            }
+        }
+    }
+
+public:
+    // 和 BufferPool 一样故意不析构，全局的流析构时还要来摘掉自己
+    static FlushScheduler &instance() {
+        static FlushScheduler *p = new FlushScheduler;
+        return *p;
+    }
+
+    void attach(BufferedOutBase &s, std::chrono::milliseconds deadline) {
+        std::chrono::milliseconds period = std::max(deadline / 2, std::chrono::milliseconds(1));
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto &e: entries) {
+            if (e->s == &s) {
+                e->period = period;
+                if (!e->in_flight)
+                    e->next = std::chrono::steady_clock::now() + period;
+                cv.notify_one();
+                return;
+            }
+        }
+        if (!s.guard)
+            s.guard = std::make_unique<std::mutex>();
+        entries.push_back(std::make_unique<Entry>(Entry{&s, period, std::chrono::steady_clock::now() + period}));
+        if (!started) {
+            started = true;
+            std::thread([this] { run(); }).detach();
+        }
+        cv.notify_one();
+    }
+
+    // 返回之后后台线程不会再碰这个流；工作线程正在做这个流的话等它做完
+    void detach(BufferedOutBase &s) {
+        std::unique_lock<std::mutex> lock(mtx);
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i]->s == &s) {
+                Entry *e = entries[i].get();
+                cv_idle.wait(lock, [&] { return !e->in_flight; });
+                // 等的时候 entries 可能变了，重新找
+                entries.erase(std::find_if(entries.begin(), entries.end(), [&](auto const &p) { return p.get() == e; }));
+                cv.notify_one();
+                return;
+            }
+        }
+    }
+
+    FlushScheduler(FlushScheduler &&) = delete;
+};
+
+inline void BufferedOutBase::schedule_flush(std::chrono::milliseconds deadline) {
+    FlushScheduler::instance().attach(*this, deadline);
+}
+
+inline BufferedOutBase::~BufferedOutBase() {
+    if (guard)
+        FlushScheduler::instance().detach(*this);
+    if (buf == nullptr)
+        return;
+    // 析构里不能抛，最后这次写失败只能不管了；在意的话析构前先自己 flush()
+    try {
+        flush_buf();
+    } catch (...) {
+    }
+    if (owns_buf)
+        BufferPool::instance().release(buf, cap);
+}
+
+enum OpenFlag {
+    Read,
+    Write,
+    Append,
+    ReadWrite,
+};
+
+inline std::map<OpenFlag, int> openFlagToUnixFlag = {
+    {OpenFlag::Read, O_RDONLY},
+    {OpenFlag::Write, O_WRONLY | O_TRUNC | O_CREAT},
+    {OpenFlag::Append, O_WRONLY | O_APPEND | O_CREAT},
+    {OpenFlag::ReadWrite, O_RDWR | O_CREAT},
+};
+
+inline std::unique_ptr<OutStream> out_file_open(const char *path, OpenFlag flag) {
+    int oflag = openFlagToUnixFlag.at(flag);
+    // oflag |= O_DIRECT;
+    int fd = open(path, oflag, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category());
+        // mperror(path);
+        return nullptr;
+    }
+    auto file = std::make_unique<UnixFileOutStream>(fd);
+    return std::make_unique<BufferedOutStream>(std::move(file));
+}
+
+inline std::unique_ptr<InStream> in_file_open(const char *path, OpenFlag flag) {
+    int oflag = openFlagToUnixFlag.at(flag);
+    // oflag |= O_DIRECT;
+    int fd = open(path, oflag, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category());
+        // mperror(path);
+        return nullptr;
+    }
+    auto file = std::make_unique<UnixFileInStream>(fd);
+    return file;
+}
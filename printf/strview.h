@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <type_traits>
+
+// 指针加长度，指向别人的缓冲区，不拥有内存。
+// 早先按 C++14 写的，那时还没有 std::string_view；现在两者可以互相隐式转换，
+// 接受 StrView 的接口直接传 std::string_view 就行，拿到的 StrView 也能当 std::string_view 用
+
+struct StrView {
+    const char *ptr = nullptr;
+    size_t len = 0;
+
+    StrView() = default;
+
+    StrView(const char *ptr_, size_t len_) : ptr(ptr_), len(len_) {
+    }
+
+    StrView(const char *s) : ptr(s), len(strlen(s)) {
+    }
+
+    StrView(std::string const &s) : ptr(s.data()), len(s.size()) {
+    }
+
+    StrView(std::string_view s) : ptr(s.data()), len(s.size()) {
+    }
+
+    operator std::string_view() const {
+        return std::string_view(ptr, len);
+    }
+
+    const char *data() const {
+        return ptr;
+    }
+
+    size_t size() const {
+        return len;
+    }
+
+    bool empty() const {
+        return len == 0;
+    }
+
+    const char *begin() const {
+        return ptr;
+    }
+
+    const char *end() const {
+        return ptr + len;
+    }
+
+    char operator[](size_t i) const {
+        return ptr[i];
+    }
+
+    StrView substr(size_t pos, size_t n = static_cast<size_t>(-1)) const {
+        pos = std::min(pos, len);
+        return StrView(ptr + pos, std::min(n, len - pos));
+    }
+
+    size_t find(char c, size_t pos = 0) const {
+        if (pos >= len)
+            return static_cast<size_t>(-1);
+        const void *p = memchr(ptr + pos, c, len - pos);
+        return p ? (const char *)p - ptr : static_cast<size_t>(-1);
+    }
+
+    int compare(StrView const &o) const {
+        size_t n = std::min(len, o.len);
+        int r = n == 0 ? 0 : memcmp(ptr, o.ptr, n);
+        if (r != 0)
+            return r;
+        return len < o.len ? -1 : len > o.len ? 1 : 0;
+    }
+
+    std::string str() const {
+        return std::string(ptr, len);
+    }
+};
+
+inline bool operator==(StrView const &a, StrView const &b) {
+    return a.len == b.len && (a.len == 0 || memcmp(a.ptr, b.ptr, a.len) == 0);
+}
+
+inline bool operator!=(StrView const &a, StrView const &b) {
+    return !(a == b);
+}
+
+inline bool operator<(StrView const &a, StrView const &b) {
+    return a.compare(b) < 0;
+}
+
+// 和 std::string_view 比较：两边都能隐式转换成对方，不单独写的话会有歧义。
+// 写成模板是为了只接住 std::string_view 本身，"abc" 这样的还是走上面 StrView 的版本
+template <class T> requires std::is_same_v<T, std::string_view>
+inline bool operator==(StrView const &a, T const &b) {
+    return a == StrView(b);
+}
+
+template <class T> requires std::is_same_v<T, std::string_view>
+inline bool operator<(StrView const &a, T const &b) {
+    return a.compare(StrView(b)) < 0;
+}
+
+template <class T> requires std::is_same_v<T, std::string_view>
+inline bool operator<(T const &a, StrView const &b) {
+    return StrView(a).compare(b) < 0;
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <system_error>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "stream.h"
+
+// 像 popen 一样起一个子进程，但同时拿到它的 stdin 和 stdout 两端。
+// 注意和 popen 一样的死锁：子进程输出写满管道而我们还在一直写它的 stdin，就会互相等。
+// 输出多的时候先 close_stdin() 再读，或者在另一个线程里读。
+
+// 调整管道容量，返回实际的容量（内核会向上取到 2 的幂个页）。
+// 超过 /proc/sys/fs/pipe-max-size 时普通用户会失败，这时保持原来的大小
+inline size_t set_pipe_size(int fd, size_t bytes) {
+    if (fcntl(fd, F_SETPIPE_SZ, (int)bytes) < 0 && errno != EPERM) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    int n = fcntl(fd, F_GETPIPE_SZ);
+    if (n < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    return n;
+}
+
+// 写管道用的缓冲流：缓冲区满了用 vmsplice 把整页直接挂进管道，不再拷贝一次。
+// vmsplice 之后管道只是引用着这些页，读端取走之前不能改，所以轮流用两个缓冲区，
+// 每个正好是管道容量那么大：一个缓冲区的页全部进了管道之后，管道里只装得下它，
+// 上一个缓冲区一定已经被读走了，可以放心覆盖。
+// 不满一个缓冲区的 flush 用普通 write 拷进去，不影响上面的推理。
+struct PipeOutStream : OutStream {
+private:
+    int fd;
+    size_t cap;
+    char *bufs[2];
+    int cur = 0;
+    size_t top = 0;
+    bool use_splice;
+
+    void write_fd(const char *s, size_t len) {
+        while (len != 0) {
+            ssize_t n = ::write(fd, s, len);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category());
+            }
+            s += n;
+            len -= n;
+        }
+    }
+
+    void splice_full() {
+        iovec iov{bufs[cur], cap};
+        while (iov.iov_len != 0) {
+            ssize_t n = ::vmsplice(fd, &iov, 1, 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EINVAL || errno == ENOSYS) {
+                    // 不支持的话以后都走 write
+                    use_splice = false;
+                    write_fd((const char *)iov.iov_base, iov.iov_len);
+                    break;
+                }
+                throw std::system_error(errno, std::generic_category());
+            }
+            iov.iov_base = (char *)iov.iov_base + n;
+            iov.iov_len -= n;
+        }
+        cur ^= 1;
+    }
+
+    void flush_full() {
+        if (use_splice) {
+            splice_full();
+        } else {
+            write_fd(bufs[cur], cap);
+        }
+        top = 0;
+    }
+
+    // 析构时最后一批 vmsplice 的页可能还在管道里没被读走。直接 munmap 掉的话，
+    // 管道手里的页引用保证数据不变；还给 malloc 或者 BufferPool 就可能被别人写坏，所以单独 mmap
+    char *map_buffer() {
+        void *p = ::mmap(nullptr, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category());
+        }
+        return (char *)p;
+    }
+
+public:
+    explicit PipeOutStream(int fd_, bool use_vmsplice = true)
+        : fd(fd_)
+    {
+        int n = fcntl(fd, F_GETPIPE_SZ);
+        // 不是管道的话照样能用，只是没有 vmsplice
+        use_splice = use_vmsplice && n > 0;
+        cap = n > 0 ? (size_t)n : BUFSIZ;
+        bufs[0] = map_buffer();
+        bufs[1] = use_splice ? map_buffer() : nullptr;
+    }
+
+    int get_fd() const {
+        return fd;
+    }
+
+    size_t capacity() const {
+        return cap;
+    }
+
+    void putchar(char c) override {
+        bufs[cur][top++] = c;
+        if (top == cap)
+            flush_full();
+    }
+
+    void write(const char *__restrict s, size_t len) override {
+        while (len != 0) {
+            size_t n = std::min(len, cap - top);
+            memcpy(bufs[cur] + top, s, n);
+            top += n;
+            s += n;
+            len -= n;
+            if (top == cap)
+                flush_full();
+        }
+    }
+
+    void flush() override {
+        write_fd(bufs[cur], top);
+        top = 0;
+    }
+
+    PipeOutStream(PipeOutStream &&) = delete;
+
+    ~PipeOutStream() {
+        flush();
+        ::munmap(bufs[0], cap);
+        if (bufs[1] != nullptr)
+            ::munmap(bufs[1], cap);
+        ::close(fd);
+    }
+};
+
+struct Subprocess {
+    pid_t pid = -1;
+    std::unique_ptr<PipeOutStream> in;      // 接到子进程的 stdin
+    std::unique_ptr<BufferedInStream> out;  // 接到子进程的 stdout
+
+    // 写完了：推出缓冲区并关闭管道，子进程读到 EOF
+    void close_stdin() {
+        in.reset();
+    }
+
+    // 关掉 stdin 等子进程退出，返回退出码，被信号杀掉返回 128 + 信号
+    int wait() {
+        close_stdin();
+        int status;
+        while (waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR)
+                throw std::system_error(errno, std::generic_category());
+        }
+        pid = -1;
+        if (WIFSIGNALED(status))
+            return 128 + WTERMSIG(status);
+        return WEXITSTATUS(status);
+    }
+
+    Subprocess() = default;
+
+    Subprocess(Subprocess &&that) noexcept
+        : pid(std::exchange(that.pid, -1))
+        , in(std::move(that.in))
+        , out(std::move(that.out))
+    {
+    }
+
+    ~Subprocess() {
+        if (pid > 0) {
+            try {
+                wait();
+            } catch (...) {
+            }
+        }
+    }
+};
+
+// argv[0] 按 PATH 查找。pipe_size 不为 0 时把两根管道都调到这么大
+inline Subprocess popen_streams(std::vector<std::string> const &argv, size_t pipe_size = 0, bool use_vmsplice = true) {
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    if (pipe2(from_child, O_CLOEXEC) < 0) {
+        int saved = errno;
+        ::close(to_child[0]);
+        ::close(to_child[1]);
+        throw std::system_error(saved, std::generic_category());
+    }
+    if (pipe_size != 0) {
+        set_pipe_size(to_child[1], pipe_size);
+        set_pipe_size(from_child[0], pipe_size);
+    }
+
+    std::vector<char *> args;
+    for (auto &a: argv)
+        args.push_back(const_cast<char *>(a.c_str()));
+    args.push_back(nullptr);
+
+    // dup2 出来的 0 和 1 没有 CLOEXEC，其余的管道端在 exec 时自动关掉
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, to_child[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, from_child[1], STDOUT_FILENO);
+    Subprocess p;
+    int err = posix_spawnp(&p.pid, args[0], &fa, nullptr, args.data(), environ);
+    posix_spawn_file_actions_destroy(&fa);
+    ::close(to_child[0]);
+    ::close(from_child[1]);
+    if (err != 0) {
+        ::close(to_child[1]);
+        ::close(from_child[0]);
+        throw std::system_error(err, std::generic_category());
+    }
+    p.in = std::make_unique<PipeOutStream>(to_child[1], use_vmsplice);
+    p.out = std::make_unique<BufferedInStream>(std::make_unique<UnixFileInStream>(from_child[0]));
+    return p;
+}
@@ -0,0 +1,639 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <system_error>
+#include "stream.h"
+#include "simd.h"
+
+// UTF-8 校验和 UTF-16 <-> UTF-8 转码，都在数据经过流的时候顺手做，省掉事后再扫一遍。
+//
+// 校验用查表法：每个字节的高 4 位、它前一个字节的高低 4 位各查一张 16 项的表（pshufb），
+// 三个结果按位与，不为 0 就是某一种错误（少了后续字节、多了后续字节、过长编码、代理、超过 U+10FFFF）；
+// 三、四字节字符的第三、四个字节另外用饱和减法检查。一次 32 个字节，纯 ASCII 的块直接跳过。
+// 某一块里查出错误时，退回逐字节的校验找出具体是哪个字节。AVX2 在运行时检测，没有时用逐字节的校验。
+// 转码只给连续的 ASCII 走 SSE2，其它字符逐个转。
+
+namespace utf8 {
+
+[[noreturn]] inline void invalid(uint64_t at, const char *encoding = "UTF-8") {
+    throw std::system_error(EILSEQ, std::generic_category(), std::string("invalid ") + encoding + " at byte " + std::to_string(at));
+}
+
+// 由第一个字节决定字符有几个字节，不可能出现在开头的字节返回 0
+inline int seq_length(unsigned char c) {
+    if (c < 0x80)
+        return 1;
+    if (c < 0xc2)
+        return 0;
+    if (c < 0xe0)
+        return 2;
+    if (c < 0xf0)
+        return 3;
+    if (c < 0xf5)
+        return 4;
+    return 0;
+}
+
+// 检查多字节字符 p[0..n) 后面的字节，第二个字节的范围取决于第一个字节
+inline bool valid_tail(const unsigned char *p, int n) {
+    unsigned char lo = 0x80, hi = 0xbf;
+    switch (p[0]) {
+    case 0xe0: lo = 0xa0; break;    // 过长编码
+    case 0xed: hi = 0x9f; break;    // 代理 U+D800..U+DFFF
+    case 0xf0: lo = 0x90; break;    // 过长编码
+    case 0xf4: hi = 0x8f; break;    // 超过 U+10FFFF
+    }
+    if (p[1] < lo || p[1] > hi)
+        return false;
+    for (int i = 2; i < n; i++)
+        if ((p[i] & 0xc0) != 0x80)
+            return false;
+    return true;
+}
+
+// [begin, end) 结尾还没写完的那个字符从哪开始（最多往回 3 个字节），结尾是完整的返回 end
+inline const char *incomplete_tail(const char *begin, const char *end) {
+    for (int i = 1; i <= 3 && end - i >= begin; i++) {
+        unsigned char c = end[-i];
+        if ((c & 0xc0) == 0x80)
+            continue;
+        return seq_length(c) > i ? end - i : end;
+    }
+    return end;
+}
+
+inline const char *find_invalid_scalar(const char *p, const char *end) {
+    while (p != end) {
+        // 8 个字节一起看是不是都是 ASCII
+        while (end - p >= 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            if ((v & 0x8080808080808080ull) != 0)
+                break;
+            p += 8;
+        }
+        if (p == end)
+            break;
+        unsigned char c = *p;
+        if (c < 0x80) {
+            ++p;
+            continue;
+        }
+        int n = seq_length(c);
+        if (n == 0 || end - p < n || !valid_tail((const unsigned char *)p, n))
+            return p;
+        p += n;
+    }
+    return nullptr;
+}
+
+#if defined(__x86_64__)
+// 前面的块都校验过了，从 p 之前最后一个字符的开头重新逐字节地看（最多往回 3 个字节）。
+// 不合法的开头（0xc0、0xf5 等）也要算上，它后面没有字节时查表查不出来
+inline const char *restart_point(const char *begin, const char *p) {
+    for (int i = 1; i <= 3 && p - i >= begin; i++) {
+        unsigned char c = p[-i];
+        if ((c & 0xc0) == 0x80)
+            continue;
+        return c >= 0xc0 ? p - i : p;
+    }
+    return p;
+}
+
+// cur 往后挪 N 个字节，空出来的位置用 prev 最后 N 个字节补上，得到每个位置前面第 N 个字节
+template <int N>
+__attribute__((target("avx2")))
+inline __m256i prev_bytes(__m256i cur, __m256i prev) {
+    return _mm256_alignr_epi8(cur, _mm256_permute2x128_si256(prev, cur, 0x21), 16 - N);
+}
+
+__attribute__((target("avx2")))
+inline const char *find_invalid_avx2(const char *p, const char *end) {
+    // 错误的种类，一种一位。OVERLONG_4 和 TOO_LARGE_1000 不会同时出现，共用一位
+    constexpr uint8_t kTooShort = 1 << 0;       // 11______ 0_______
+    constexpr uint8_t kTooLong = 1 << 1;        // 0_______ 10______
+    constexpr uint8_t kOverlong3 = 1 << 2;      // 11100000 100_____
+    constexpr uint8_t kTooLarge = 1 << 3;       // 11110100 1001____ 等
+    constexpr uint8_t kSurrogate = 1 << 4;      // 11101101 101_____
+    constexpr uint8_t kOverlong2 = 1 << 5;      // 1100000_ 10______
+    constexpr uint8_t kTooLarge1000 = 1 << 6;   // 11110101 1000____ 等
+    constexpr uint8_t kOverlong4 = 1 << 6;      // 11110000 1000____
+    constexpr uint8_t kTwoConts = 1 << 7;       // 10______ 10______
+    constexpr uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+
+    // 前一个字节的高 4 位
+    alignas(16) static constexpr uint8_t byte1_high[16] = {
+        kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong,
+        kTwoConts, kTwoConts, kTwoConts, kTwoConts,
+        kTooShort | kOverlong2,
+        kTooShort,
+        kTooShort | kOverlong3 | kSurrogate,
+        kTooShort | kTooLarge | kTooLarge1000 | kOverlong4,
+    };
+    // 前一个字节的低 4 位
+    alignas(16) static constexpr uint8_t byte1_low[16] = {
+        kCarry | kOverlong3 | kOverlong2 | kOverlong4,
+        kCarry | kOverlong2,
+        kCarry,
+        kCarry,
+        kCarry | kTooLarge,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000 | kSurrogate,
+        kCarry | kTooLarge | kTooLarge1000,
+        kCarry | kTooLarge | kTooLarge1000,
+    };
+    // 这个字节的高 4 位
+    alignas(16) static constexpr uint8_t byte2_high[16] = {
+        kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort,
+        kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4,
+        kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge,
+        kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+        kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge,
+        kTooShort, kTooShort, kTooShort, kTooShort,
+    };
+
+    const char *begin = p;
+    __m256i t1h = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)byte1_high));
+    __m256i t1l = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)byte1_low));
+    __m256i t2h = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)byte2_high));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i zero = _mm256_setzero_si256();
+    // 块的最后 3 个字节分别大于等于 0xf0、0xe0、0xc0 时，字符没写完，后面必须有后续字节
+    __m256i max_tail = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                        (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+    __m256i prev = zero;
+    __m256i prev_incomplete = zero;
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)p);
+        __m256i err;
+        if (_mm256_movemask_epi8(x) == 0) {
+            err = prev_incomplete;
+            prev_incomplete = zero;
+        } else {
+            __m256i prev1 = prev_bytes<1>(x, prev);
+            __m256i sc = _mm256_and_si256(
+                _mm256_and_si256(_mm256_shuffle_epi8(t1h, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), mask)),
+                                 _mm256_shuffle_epi8(t1l, _mm256_and_si256(prev1, mask))),
+                _mm256_shuffle_epi8(t2h, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask)));
+            // 前面第 2 个字节是三、四字节字符的开头，或者前面第 3 个字节是四字节字符的开头，这里就必须是后续字节
+            __m256i must23 = _mm256_or_si256(_mm256_subs_epu8(prev_bytes<2>(x, prev), _mm256_set1_epi8((char)(0xe0 - 0x80))),
+                                             _mm256_subs_epu8(prev_bytes<3>(x, prev), _mm256_set1_epi8((char)(0xf0 - 0x80))));
+            err = _mm256_xor_si256(_mm256_and_si256(must23, _mm256_set1_epi8((char)0x80)), sc);
+            prev_incomplete = _mm256_subs_epu8(x, max_tail);
+        }
+        // 错误可能属于从上一块结尾开始的字符
+        if (!_mm256_testz_si256(err, err))
+            return find_invalid_scalar(restart_point(begin, p), end);
+        prev = x;
+        p += 32;
+    }
+    return find_invalid_scalar(restart_point(begin, p), end);
+}
+#endif
+
+// [p, end) 里第一个不合法的字符从哪开始，全都合法返回 nullptr。结尾的字符没写完也算不合法
+inline const char *find_invalid(const char *p, const char *end) {
+#if defined(__x86_64__)
+    if (simd::has_avx2())
+        return find_invalid_avx2(p, end);
+#endif
+    return find_invalid_scalar(p, end);
+}
+
+inline bool valid(const char *p, size_t n) {
+    return find_invalid(p, p + n) == nullptr;
+}
+
+inline uint32_t load16(const unsigned char *p, bool big) {
+    return big ? (uint32_t)p[0] << 8 | p[1] : (uint32_t)p[1] << 8 | p[0];
+}
+
+inline void store16(unsigned char *p, uint32_t u, bool big) {
+    p[big ? 0 : 1] = (unsigned char)(u >> 8);
+    p[big ? 1 : 0] = (unsigned char)u;
+}
+
+// 把 UTF-16 转成 UTF-8，in、out 跟着往前走。in 剩下不到一个字符或者 out 放不下下一个字符时停下。
+// 遇到不成对的代理返回 false，in 停在它那里
+inline bool utf16_to_utf8(const char *&in, const char *in_end, char *&out, char *out_end, bool big) {
+    const unsigned char *p = (const unsigned char *)in;
+    const unsigned char *e = (const unsigned char *)in_end;
+    unsigned char *o = (unsigned char *)out;
+    unsigned char *oe = (unsigned char *)out_end;
+    bool ok = true;
+    while (true) {
+#if defined(__x86_64__)
+        // 8 个 ASCII 一起转
+        while (e - p >= 16 && oe - o >= 8) {
+            __m128i x = _mm_loadu_si128((const __m128i *)p);
+            if (big)
+                x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+            __m128i high = _mm_and_si128(x, _mm_set1_epi16((short)0xff80));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) != 0xffff)
+                break;
+            _mm_storel_epi64((__m128i *)o, _mm_packus_epi16(x, x));
+            p += 16;
+            o += 8;
+        }
+#endif
+        if (e - p < 2)
+            break;
+        uint32_t u = load16(p, big);
+        int used = 2;
+        if (u >= 0xd800 && u < 0xdc00) {
+            if (e - p < 4)
+                break;
+            uint32_t v = load16(p + 2, big);
+            if (v < 0xdc00 || v >= 0xe000) {
+                ok = false;
+                break;
+            }
+            u = 0x10000 + ((u - 0xd800) << 10) + (v - 0xdc00);
+            used = 4;
+        } else if (u >= 0xdc00 && u < 0xe000) {
+            ok = false;
+            break;
+        }
+        int n = u < 0x80 ? 1 : u < 0x800 ? 2 : u < 0x10000 ? 3 : 4;
+        if (oe - o < n)
+            break;
+        switch (n) {
+        case 1:
+            o[0] = (unsigned char)u;
+            break;
+        case 2:
+            o[0] = (unsigned char)(0xc0 | u >> 6);
+            o[1] = (unsigned char)(0x80 | (u & 0x3f));
+            break;
+        case 3:
+            o[0] = (unsigned char)(0xe0 | u >> 12);
+            o[1] = (unsigned char)(0x80 | (u >> 6 & 0x3f));
+            o[2] = (unsigned char)(0x80 | (u & 0x3f));
+            break;
+        default:
+            o[0] = (unsigned char)(0xf0 | u >> 18);
+            o[1] = (unsigned char)(0x80 | (u >> 12 & 0x3f));
+            o[2] = (unsigned char)(0x80 | (u >> 6 & 0x3f));
+            o[3] = (unsigned char)(0x80 | (u & 0x3f));
+            break;
+        }
+        p += used;
+        o += n;
+    }
+    in = (const char *)p;
+    out = (char *)o;
+    return ok;
+}
+
+// 把 UTF-8 转成 UTF-16，in、out 跟着往前走。in 剩下一个没写完的字符或者 out 放不下下一个字符时停下。
+// 遇到不合法的字符返回 false，in 停在它那里
+inline bool utf8_to_utf16(const char *&in, const char *in_end, char *&out, char *out_end, bool big) {
+    const unsigned char *p = (const unsigned char *)in;
+    const unsigned char *e = (const unsigned char *)in_end;
+    unsigned char *o = (unsigned char *)out;
+    unsigned char *oe = (unsigned char *)out_end;
+    bool ok = true;
+    while (true) {
+#if defined(__x86_64__)
+        // 16 个 ASCII 一起转
+        while (e - p >= 16 && oe - o >= 32) {
+            __m128i x = _mm_loadu_si128((const __m128i *)p);
+            if (_mm_movemask_epi8(x) != 0)
+                break;
+            __m128i zero = _mm_setzero_si128();
+            __m128i lo = big ? _mm_unpacklo_epi8(zero, x) : _mm_unpacklo_epi8(x, zero);
+            __m128i hi = big ? _mm_unpackhi_epi8(zero, x) : _mm_unpackhi_epi8(x, zero);
+            _mm_storeu_si128((__m128i *)o, lo);
+            _mm_storeu_si128((__m128i *)(o + 16), hi);
+            p += 16;
+            o += 32;
+        }
+#endif
+        if (p == e)
+            break;
+        int n = seq_length(*p);
+        if (n == 0) {
+            ok = false;
+            break;
+        }
+        if (e - p < n)
+            break;
+        if (n > 1 && !valid_tail(p, n)) {
+            ok = false;
+            break;
+        }
+        uint32_t u;
+        switch (n) {
+        case 1:
+            u = p[0];
+            break;
+        case 2:
+            u = (p[0] & 0x1f) << 6 | (p[1] & 0x3f);
+            break;
+        case 3:
+            u = (p[0] & 0x0f) << 12 | (p[1] & 0x3f) << 6 | (p[2] & 0x3f);
+            break;
+        default:
+            u = (p[0] & 0x07) << 18 | (p[1] & 0x3f) << 12 | (p[2] & 0x3f) << 6 | (p[3] & 0x3f);
+            break;
+        }
+        if (u >= 0x10000) {
+            if (oe - o < 4)
+                break;
+            u -= 0x10000;
+            store16(o, 0xd800 + (u >> 10), big);
+            store16(o + 2, 0xdc00 + (u & 0x3ff), big);
+            o += 4;
+        } else {
+            if (oe - o < 2)
+                break;
+            store16(o, u, big);
+            o += 2;
+        }
+        p += n;
+    }
+    in = (const char *)p;
+    out = (char *)o;
+    return ok;
+}
+
+}
+
+
+// 读的时候校验 UTF-8，不合法时抛 EILSEQ，what() 里有出错的字节偏移。
+// 交出去的总是完整的字符：一块结尾没读完的字符先扣下，和下一块拼起来再交出去
+struct Utf8ValidatingInStream : InStream {
+private:
+    std::unique_ptr<InStream> in;
+    char pend[4];           // 上一块结尾没读完的字符
+    size_t npend = 0;
+    char small[256];        // 调用方的缓冲区放不下一个完整字符时（getchar 等）先读到这里
+    size_t top = 0;
+    size_t max = 0;
+    uint64_t offset = 0;    // 校验过的字节数
+    bool eof = false;
+
+    // 读一块到 s 并校验，len 至少是 4
+    size_t fill(char *__restrict s, size_t len) {
+        while (true) {
+            memcpy(s, pend, npend);
+            size_t have = npend;
+            size_t n = eof ? 0 : in->read(s + have, len - have);
+            if (n == 0) {
+                eof = true;
+                if (npend != 0)
+                    utf8::invalid(offset);
+                return 0;
+            }
+            have += n;
+            const char *cut = utf8::incomplete_tail(s, s + have);
+            if (const char *bad = utf8::find_invalid(s, cut))
+                utf8::invalid(offset + (bad - s));
+            npend = s + have - cut;
+            memcpy(pend, cut, npend);
+            offset += cut - s;
+            if (cut != s)
+                return cut - s;
+        }
+    }
+
+public:
+    explicit Utf8ValidatingInStream(std::unique_ptr<InStream> in_) : in(std::move(in_)) {
+    }
+
+    int getchar() override {
+        if (top == max) {
+            top = 0;
+            max = fill(small, sizeof(small));
+            if (max == 0)
+                return EOF;
+        }
+        return (unsigned char)small[top++];
+    }
+
+    size_t read(char *__restrict s, size_t len) override {
+        if (len == 0)
+            return 0;
+        if (top == max && len < 4) {
+            top = 0;
+            max = fill(small, sizeof(small));
+        }
+        if (top != max) {
+            size_t n = std::min(len, max - top);
+            memcpy(s, small + top, n);
+            top += n;
+            return n;
+        }
+        return fill(s, len);
+    }
+
+    Utf8ValidatingInStream(Utf8ValidatingInStream &&) = delete;
+};
+
+
+// Detect 只用于读：看开头的 BOM 决定字节序，没有 BOM 当作小端
+enum class Utf16Order {
+    Little,
+    Big,
+    Detect,
+};
+
+// 把 UTF-16 的输入转成 UTF-8 读出来，开头的 BOM 不交出去。
+// 不成对的代理、结尾剩下半个字符都抛 EILSEQ，偏移是 UTF-16 输入里的字节偏移
+struct Utf16ToUtf8InStream : InStream {
+private:
+    std::unique_ptr<InStream> in;
+    std::vector<char> raw;  // 读进来还没转的 UTF-16 是 [rtop, rmax)
+    size_t rtop = 0;
+    size_t rmax = 0;
+    char small[256];
+    size_t top = 0;
+    size_t max = 0;
+    uint64_t consumed = 0;  // 转掉的输入字节数
+    Utf16Order order;
+    bool eof = false;
+
+    void refill_raw() {
+        memmove(raw.data(), raw.data() + rtop, rmax - rtop);
+        rmax -= rtop;
+        rtop = 0;
+        size_t n = in->read(raw.data() + rmax, raw.size() - rmax);
+        if (n == 0)
+            eof = true;
+        rmax += n;
+        if (order == Utf16Order::Detect && (rmax >= 2 || eof)) {
+            order = Utf16Order::Little;
+            if (rmax >= 2) {
+                unsigned char b0 = raw[0], b1 = raw[1];
+                if (b0 == 0xff && b1 == 0xfe) {
+                    rtop = 2;
+                } else if (b0 == 0xfe && b1 == 0xff) {
+                    order = Utf16Order::Big;
+                    rtop = 2;
+                }
+            }
+            consumed += rtop;
+        }
+    }
+
+    // 转一段到 s，len 至少是 4
+    size_t fill(char *__restrict s, size_t len) {
+        while (true) {
+            if (order != Utf16Order::Detect) {
+                const char *p = raw.data() + rtop;
+                char *o = s;
+                bool ok = utf8::utf16_to_utf8(p, raw.data() + rmax, o, s + len, order == Utf16Order::Big);
+                consumed += p - (raw.data() + rtop);
+                rtop = p - raw.data();
+                if (!ok)
+                    utf8::invalid(consumed, "UTF-16");
+                if (o != s)
+                    return o - s;
+            }
+            if (eof) {
+                if (rtop != rmax)
+                    utf8::invalid(consumed, "UTF-16");
+                return 0;
+            }
+            refill_raw();
+        }
+    }
+
+public:
+    explicit Utf16ToUtf8InStream(std::unique_ptr<InStream> in_, Utf16Order order_ = Utf16Order::Detect)
+        : in(std::move(in_))
+        , raw(64 * 1024)
+        , order(order_)
+    {
+    }
+
+    int getchar() override {
+        if (top == max) {
+            top = 0;
+            max = fill(small, sizeof(small));
+            if (max == 0)
+                return EOF;
+        }
+        return (unsigned char)small[top++];
+    }
+
+    size_t read(char *__restrict s, size_t len) override {
+        if (len == 0)
+            return 0;
+        if (top == max && len < 4) {
+            top = 0;
+            max = fill(small, sizeof(small));
+        }
+        if (top != max) {
+            size_t n = std::min(len, max - top);
+            memcpy(s, small + top, n);
+            top += n;
+            return n;
+        }
+        return fill(s, len);
+    }
+
+    Utf16ToUtf8InStream(Utf16ToUtf8InStream &&) = delete;
+};
+
+
+// 写进来的 UTF-8 转成 UTF-16 写出去，bom 为 true 时先写一个 BOM（Detect 当作小端）。
+// 一次 write 可以断在字符中间，剩下的半个字符和下一次 write 拼起来。
+// 不合法的 UTF-8 抛 EILSEQ，偏移是写进来的 UTF-8 里的字节偏移；finish 时还剩半个字符也算
+struct Utf8ToUtf16OutStream : OutStream {
+private:
+    std::unique_ptr<OutStream> out;
+    bool big;
+    char pend[4];           // 上一次 write 结尾没写完的字符
+    size_t npend = 0;
+    uint64_t offset = 0;    // 转掉的输入字节数
+    bool finished = false;
+
+    // 转 [p, end)，返回剩下没转的开头
+    const char *convert(const char *p, const char *end) {
+        char buf[16 * 1024];
+        while (true) {
+            const char *q = p;
+            char *o = buf;
+            bool ok = utf8::utf8_to_utf16(q, end, o, buf + sizeof(buf), big);
+            offset += q - p;
+            if (o != buf)
+                out->write(buf, o - buf);
+            if (!ok)
+                utf8::invalid(offset);
+            if (q == p)
+                return p;
+            p = q;
+        }
+    }
+
+public:
+    explicit Utf8ToUtf16OutStream(std::unique_ptr<OutStream> out_, Utf16Order order_ = Utf16Order::Little, bool bom = false)
+        : out(std::move(out_))
+        , big(order_ == Utf16Order::Big)
+    {
+        if (bom) {
+            unsigned char b[2];
+            utf8::store16(b, 0xfeff, big);
+            out->write((const char *)b, 2);
+        }
+    }
+
+    void write(const char *__restrict s, size_t len) override {
+        if (npend != 0) {
+            // 先把上次剩下的半个字符补完
+            char tmp[8];
+            size_t take = std::min(len, sizeof(tmp) - npend);
+            memcpy(tmp, pend, npend);
+            memcpy(tmp + npend, s, take);
+            size_t done = convert(tmp, tmp + npend + take) - tmp;
+            if (done == 0) {
+                npend += take;
+                memcpy(pend, tmp, npend);
+                return;
+            }
+            s += done - npend;
+            len -= done - npend;
+            npend = 0;
+        }
+        const char *rest = convert(s, s + len);
+        npend = s + len - rest;
+        memcpy(pend, rest, npend);
+    }
+
+    void flush() override {
+        out->flush();
+    }
+
+    void finish() {
+        if (finished)
+            return;
+        finished = true;
+        if (npend != 0)
+            utf8::invalid(offset);
+        out->flush();
+    }
+
+    Utf8ToUtf16OutStream(Utf8ToUtf16OutStream &&) = delete;
+
+    // 剩半个字符或者 flush 失败在这里都只能吞掉；要拿到 EILSEQ 就在析构前自己调 finish()
+    ~Utf8ToUtf16OutStream() {
+        try {
+            finish();
+        } catch (...) {
+        }
+    }
+};